@@ -14,13 +14,11 @@
 Ui::Ui(sdl::Window &window,
        SDL_GLContext gl_context,
        Database &db,
-       std::vector<Sample> &samples_data,
        const std::string &initial_filter,
        int initial_selected_sample_idx)
   : m_window(window),
     m_gl_context(gl_context),
     m_db(db),
-    m_samples_data(samples_data),
     m_running(true),
     m_selected_sample_idx(initial_selected_sample_idx),
     filter(initial_filter)
@@ -34,19 +32,9 @@ Ui::Ui(sdl::Window &window,
   ImGui::StyleColorsDark();
   ImGui_ImplSDL2_InitForOpenGL(m_window.get(), m_gl_context);
   ImGui_ImplOpenGL3_Init("#version 130");
-  m_db.load_samples(m_samples_data, filter);
-  if (m_selected_sample_idx >= 0 && static_cast<size_t>(m_selected_sample_idx) < m_samples_data.size())
-  {
-    m_scroll_to_selected = true;
-  }
-  if (m_selected_sample_idx >= 0 && static_cast<size_t>(m_selected_sample_idx) < m_samples_data.size())
-  {
-    m_scroll_to_selected = true;
-  }
-  if (m_selected_sample_idx >= 0 && static_cast<size_t>(m_selected_sample_idx) < m_samples_data.size())
-  {
-    m_scroll_to_selected = true;
-  }
+  m_samples = std::make_shared<ResultSet>(m_db, m_executor);
+  reload();
+  m_scroll_to_selected = m_selected_sample_idx >= 0;
 }
 
 Ui::~Ui()
@@ -59,6 +47,19 @@ Ui::~Ui()
 bool Ui::processEvent(SDL_Event &event)
 {
   ImGui_ImplSDL2_ProcessEvent(&event);
+  switch (event.type)
+  {
+  case SDL_KEYDOWN:
+  case SDL_KEYUP:
+  case SDL_TEXTINPUT:
+  case SDL_MOUSEMOTION:
+  case SDL_MOUSEBUTTONDOWN:
+  case SDL_MOUSEBUTTONUP:
+  case SDL_MOUSEWHEEL:
+  case SDL_DROPFILE:
+    m_last_input = std::chrono::steady_clock::now();
+    break;
+  }
   if (event.type == SDL_QUIT)
   {
     m_running = false;
@@ -77,6 +78,16 @@ void Ui::render()
   ImGui_ImplSDL2_NewFrame();
   ImGui::NewFrame();
 
+  m_executor.poll();
+  applyChanges();
+  // Upkeep only while nobody is using the app; any input stops the slice in
+  // flight before the next frame.
+  const bool idle = std::chrono::steady_clock::now() - m_last_input >
+                      std::chrono::milliseconds(maintenance_idle_ms) &&
+                    !m_query && !m_change_query && !m_facet_query && !m_backup && !m_transfer &&
+                    !m_scan;
+  m_maintenance.tick(idle);
+
   // Create a full-window ImGui window to contain all content
   ImGuiViewport *viewport = ImGui::GetMainViewport();
   ImGui::SetNextWindowPos(viewport->WorkPos);
@@ -102,22 +113,60 @@ void Ui::render()
           extract_metadata_and_insert(lTheOpenFileName);
         }
       }
-      if (ImGui::MenuItem("Scan Directory"))
+      if (ImGui::MenuItem("Scan Directory", nullptr, false, !m_scan))
       {
         char const *lTheSelectedDirectory = tinyfd_selectFolderDialog("Select a directory to scan", "");
         if (lTheSelectedDirectory)
         {
           LOG("Selected directory: ", lTheSelectedDirectory);
-          m_db.scan_directory(lTheSelectedDirectory);
-          m_db.load_samples(m_samples_data, filter);
+          startScan(lTheSelectedDirectory);
         }
       }
+      if (m_scan && ImGui::MenuItem("Cancel Scan"))
+        m_scan->cancel();
+      ImGui::Separator();
+      if (ImGui::MenuItem("Back Up Library...", nullptr, false, !m_backup))
+      {
+        const char *patterns[] = {"*.db"};
+        if (const char *target =
+              tinyfd_saveFileDialog("Back up the library to", "sfx-backup.db", 1, patterns, "Database"))
+          startBackup(target);
+      }
+      if (m_backup && ImGui::MenuItem("Cancel Backup"))
+        m_backup->cancel();
+      const char *export_patterns[] = {"*.sfx"};
+      if (ImGui::MenuItem("Export Library...", nullptr, false, !m_transfer))
+      {
+        if (const char *target = tinyfd_saveFileDialog(
+              "Export the library to", "sfx-library.sfx", 1, export_patterns, "Sample export"))
+          startTransfer(false, target);
+      }
+      if (ImGui::MenuItem("Import Library...", nullptr, false, !m_transfer))
+      {
+        if (const char *source = tinyfd_openFileDialog(
+              "Import samples from", "", 1, export_patterns, "Sample export", 0))
+          startTransfer(true, source);
+      }
+      if (m_transfer && ImGui::MenuItem(m_transfer_import ? "Cancel Import" : "Cancel Export"))
+        m_transfer->cancel();
+      ImGui::Separator();
       if (ImGui::MenuItem("Exit"))
       {
         m_running = false;
       }
       ImGui::EndMenu();
     }
+    if (ImGui::BeginMenu("View"))
+    {
+      ImGui::MenuItem("Facets", nullptr, &m_show_facets);
+      ImGui::MenuItem("Query Profiler", nullptr, &m_show_profiler);
+      ImGui::EndMenu();
+    }
+    if (ImGui::BeginMenu("Smart Folders"))
+    {
+      renderSmartFoldersMenu();
+      ImGui::EndMenu();
+    }
     ImGui::EndMainMenuBar();
   }
 
@@ -125,15 +174,72 @@ void Ui::render()
   ImGui::Text("Sound Samples");
   if (ImGui::InputText("Filter", &filter, ImGuiInputTextFlags_EnterReturnsTrue))
   {
-    m_db.load_samples(m_samples_data, filter);
+    reload();
     ImGui::SetKeyboardFocusHere(-1); // Keep focus on the input text after pressing Enter
   }
+  else if (m_live_search && filter != m_live_filter)
+  {
+    reload(true);
+  }
+  ImGui::SameLine();
+  ImGui::Checkbox("Live", &m_live_search);
+  if (m_query)
+    ImGui::TextDisabled("Searching...");
+  else if (m_query_over_budget)
+    ImGui::TextDisabled("Over the %d ms live search budget, press Enter to run the query",
+                        live_query_budget_ms);
+  else
+    ImGui::TextDisabled("%zu samples", m_samples->size());
+  if (m_backup)
+  {
+    const int total = m_backup_total;
+    ImGui::SameLine();
+    ImGui::TextDisabled("Backing up... %d%%", total > 0 ? 100 * m_backup_copied / total : 0);
+  }
+  else if (!m_backup_status.empty())
+  {
+    ImGui::SameLine();
+    ImGui::TextDisabled("%s", m_backup_status.c_str());
+  }
+  if (m_scan)
+  {
+    ImGui::SameLine();
+    ImGui::TextDisabled("Scanning... %zu samples", m_scan_added.load());
+  }
+  else if (!m_scan_status.empty())
+  {
+    ImGui::SameLine();
+    ImGui::TextDisabled("%s", m_scan_status.c_str());
+  }
+  if (m_transfer)
+  {
+    const size_t total = m_transfer_total;
+    ImGui::SameLine();
+    ImGui::TextDisabled("%s... %zu%%",
+                        m_transfer_import ? "Importing" : "Exporting",
+                        total > 0 ? 100 * m_transfer_done / total : 0);
+  }
+  else if (!m_transfer_status.empty())
+  {
+    ImGui::SameLine();
+    ImGui::TextDisabled("%s", m_transfer_status.c_str());
+  }
+  for (const auto &error : m_filter_errors)
+    ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s", error.c_str());
 
   // Calculate remaining height for the child window
   float footer_height_to_reserve =
     ImGui::GetStyle().ItemSpacing.y; // Adjust as needed for other elements below
   ImVec2 child_size = ImVec2(0, -footer_height_to_reserve);
 
+  if (m_show_facets)
+  {
+    ImGui::BeginChild("FacetsChild", ImVec2(220, child_size.y), ImGuiChildFlags_ResizeX);
+    renderFacets();
+    ImGui::EndChild();
+    ImGui::SameLine();
+  }
+
   ImGui::BeginChild(
     "SampleListChild", child_size, ImGuiChildFlags_None, ImGuiWindowFlags_AlwaysVerticalScrollbar);
 
@@ -148,7 +254,7 @@ void Ui::render()
   }
   if (ImGui::IsKeyPressed(ImGuiKey_DownArrow))
   {
-    if (m_selected_sample_idx < (int)m_samples_data.size() - 1)
+    if (m_selected_sample_idx < (int)m_samples->size() - 1)
     {
       m_selected_sample_idx++;
       m_scroll_to_selected = true;
@@ -166,9 +272,9 @@ void Ui::render()
   }
   if (ImGui::IsKeyPressed(ImGuiKey_PageDown))
   {
-    if (m_selected_sample_idx < (int)m_samples_data.size() - 1)
+    if (m_selected_sample_idx < (int)m_samples->size() - 1)
     {
-      m_selected_sample_idx = std::min((int)m_samples_data.size() - 1, m_selected_sample_idx + 10);
+      m_selected_sample_idx = std::min((int)m_samples->size() - 1, m_selected_sample_idx + 10);
       m_scroll_to_selected = true;
       playAndClipboardSample();
     }
@@ -190,15 +296,23 @@ void Ui::render()
     ImGui::TableHeadersRow();
 
     ImGuiListClipper clipper;
-    clipper.Begin(m_samples_data.size());
+    clipper.Begin(m_samples->size());
     while (clipper.Step())
     {
+      m_samples->fetch(clipper.DisplayStart, clipper.DisplayEnd);
       for (int row_num = clipper.DisplayStart; row_num < clipper.DisplayEnd; row_num++)
       {
+        const Sample *sample = m_samples->row(row_num);
         ImGui::PushID(row_num); // Push unique ID for each row
         ImGui::TableNextRow();
         ImGui::TableSetColumnIndex(0);
-        if (ImGui::Selectable(m_samples_data[row_num].filepath.c_str(),
+        if (!sample)
+        {
+          ImGui::TextDisabled("...");
+          ImGui::PopID();
+          continue;
+        }
+        if (ImGui::Selectable(sample->filepath.c_str(),
                               m_selected_sample_idx == row_num,
                               ImGuiSelectableFlags_SpanAllColumns))
         {
@@ -212,17 +326,17 @@ void Ui::render()
           m_scroll_to_selected = false;
         }
         ImGui::TableSetColumnIndex(1);
-        ImGui::Text("%lld KB", m_samples_data[row_num].size / 1024);
+        ImGui::Text("%lld KB", sample->size / 1024);
         ImGui::TableSetColumnIndex(2);
-        ImGui::Text("%.2f s", m_samples_data[row_num].duration);
+        ImGui::Text("%.2f s", sample->duration);
         ImGui::TableSetColumnIndex(3);
-        ImGui::Text("%d Hz", m_samples_data[row_num].sample_rate);
+        ImGui::Text("%d Hz", sample->sample_rate);
         ImGui::TableSetColumnIndex(4);
-        ImGui::Text("%d bit", m_samples_data[row_num].bit_depth);
+        ImGui::Text("%d bit", sample->bit_depth);
         ImGui::TableSetColumnIndex(5);
-        ImGui::Text("%d channels", m_samples_data[row_num].channels);
+        ImGui::Text("%d channels", sample->channels);
         ImGui::TableSetColumnIndex(6);
-        ImGui::Text("%s", m_samples_data[row_num].tags.c_str());
+        ImGui::Text("%s", sample->tags.c_str());
         ImGui::PopID(); // Pop the ID
       }
     }
@@ -233,25 +347,399 @@ void Ui::render()
 
   ImGui::End();
 
+  if (m_show_profiler)
+    renderProfiler();
+
   ImGui::Render();
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
   m_window.glSwap();
 }
 
+void Ui::renderFacets()
+{
+  static constexpr size_t max_values = 20;
+  const bool refinable = !FilterAst::parse(filter).raw;
+  for (size_t i = 0; i < m_facets.size(); ++i)
+  {
+    const auto &facet = m_facets[i];
+    if (facet.values.empty() ||
+        !ImGui::CollapsingHeader(facet.name.c_str(), ImGuiTreeNodeFlags_DefaultOpen))
+      continue;
+    ImGui::PushID(static_cast<int>(i));
+    for (size_t j = 0; j < std::min(facet.values.size(), max_values); ++j)
+    {
+      const auto &value = facet.values[j];
+      ImGui::PushID(static_cast<int>(j));
+      const auto label = value.label + " (" + std::to_string(value.count) + ")";
+      if (value.term.empty() || !refinable)
+        ImGui::TextDisabled("%s", label.c_str());
+      else if (ImGui::Selectable(label.c_str()))
+        refine(value.term);
+      ImGui::PopID();
+    }
+    if (facet.values.size() > max_values)
+      ImGui::TextDisabled("%zu more", facet.values.size() - max_values);
+    ImGui::PopID();
+  }
+}
+
+void Ui::refine(const std::string &term)
+{
+  if (!filter.empty() && filter.back() != ' ')
+    filter += ' ';
+  filter += term;
+  reload();
+}
+
+void Ui::renderSmartFoldersMenu()
+{
+  // Member counts are read each time the menu opens.
+  if (ImGui::IsWindowAppearing())
+    m_smart_folders = m_db.smart_folders();
+  if (ImGui::MenuItem("Save Filter as Smart Folder...", nullptr, false, !filter.empty()))
+  {
+    if (const char *name = tinyfd_inputBox("Save Smart Folder", "Name for the current filter", ""))
+      // Filling a new folder runs the filter once over the whole library.
+      m_executor.submit([this, name = std::string{name}, filter = filter](QueryToken &) {
+        m_db.save_smart_folder(name, filter);
+      });
+  }
+  if (m_smart_folders.empty())
+    return;
+  ImGui::Separator();
+  for (const auto &folder : m_smart_folders)
+  {
+    const auto label = folder.name + " (" + std::to_string(folder.size) + ")";
+    if (ImGui::MenuItem(label.c_str()))
+    {
+      filter = "folder:" + FilterAst::quote(folder.name);
+      reload();
+    }
+    if (ImGui::IsItemHovered())
+      ImGui::SetTooltip("%s", folder.filter.c_str());
+  }
+  ImGui::Separator();
+  if (ImGui::BeginMenu("Delete"))
+  {
+    for (const auto &folder : m_smart_folders)
+      if (ImGui::MenuItem(folder.name.c_str()))
+        m_executor.submit(
+          [this, name = folder.name](QueryToken &) { m_db.delete_smart_folder(name); });
+    ImGui::EndMenu();
+  }
+}
+
+void Ui::renderProfiler()
+{
+  ImGui::SetNextWindowSize(ImVec2(600, 400), ImGuiCond_FirstUseEver);
+  if (!ImGui::Begin("Query Profiler", &m_show_profiler))
+  {
+    ImGui::End();
+    return;
+  }
+  auto &profiler = m_db.profiler();
+  float slow_ms = profiler.slow_ms();
+  if (ImGui::InputFloat("Slow threshold (ms)", &slow_ms, 1.0f, 10.0f, "%.1f"))
+    profiler.set_slow_ms(std::max(0.0f, slow_ms));
+  ImGui::Text("%zu statements, %.1f ms total", profiler.queries(), profiler.total_ms());
+  ImGui::Text(
+    "Statement cache: %zu hits, %zu misses", m_db.stmt_cache_hits(), m_db.stmt_cache_misses());
+  ImGui::Separator();
+
+  const auto slow = profiler.slow_queries();
+  if (slow.empty())
+    ImGui::TextDisabled("No slow queries");
+  for (size_t i = 0; i < slow.size(); ++i)
+  {
+    const auto &q = slow[i];
+    ImGui::PushID(static_cast<int>(i));
+    if (ImGui::TreeNode("query", "%.1f ms  %s", q.prepare_ms + q.run_ms, q.sql.c_str()))
+    {
+      ImGui::Text("prepare %.2f ms, run %.2f ms, %lld rows", q.prepare_ms, q.run_ms, q.rows);
+      ImGui::Text("%d VM steps, %d full scan steps, %d sorts, %d automatic indexes",
+                  q.vm_steps,
+                  q.fullscan_steps,
+                  q.sorts,
+                  q.autoindexes);
+      ImGui::TextUnformatted(q.plan.c_str());
+      ImGui::TreePop();
+    }
+    ImGui::PopID();
+  }
+  renderMaintenance();
+  ImGui::End();
+}
+
+void Ui::renderMaintenance()
+{
+  if (!ImGui::CollapsingHeader("Idle maintenance"))
+    return;
+  const auto &history = m_maintenance.history();
+  if (history.empty())
+    ImGui::TextDisabled("Nothing has run yet");
+  else if (ImGui::BeginTable("maintenance", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+  {
+    ImGui::TableSetupColumn("Task");
+    ImGui::TableSetupColumn("Time (ms)");
+    ImGui::TableSetupColumn("Result");
+    ImGui::TableHeadersRow();
+    for (const auto &run : history)
+    {
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(MaintenanceScheduler::name(run.task));
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f", run.ms);
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(run.interrupted ? "interrupted" : run.done ? "done" : "more to do");
+    }
+    ImGui::EndTable();
+  }
+}
+
 void Ui::extract_metadata_and_insert(const char *filepath)
 {
   auto new_sample = AudioPlayer::extract_meta_data(filepath);
   if (new_sample.filepath.empty())
     return;
   m_db.insert_sample(new_sample);
-  m_db.load_samples(m_samples_data, filter);
+}
+
+void Ui::reload(bool live)
+{
+  auto ast = FilterAst::parse(filter);
+  m_filter_errors = ast.errors;
+  m_live_filter = filter;
+  m_query_over_budget = false;
+
+  // Only the latest query matters: the stale one is interrupted mid-statement
+  // and whatever it still posts is ignored.
+  if (m_query)
+    m_query->cancel();
+  if (m_change_query)
+    m_change_query->cancel();
+  m_change_query = nullptr;
+  m_db_generation = m_db.generation();
+  m_attached_generation = m_db.attached_generation();
+  m_query = nullptr;
+
+  // A recent filter comes back as it was left. If the data has moved since,
+  // the stale generation makes applyChanges() catch the rows up.
+  auto key = ast.normalized();
+  if (auto *entry = m_cache.find(key))
+  {
+    if (entry->attached_generation == m_attached_generation)
+    {
+      m_samples = entry->samples;
+      m_samples_key = std::move(key);
+      m_db_generation = entry->generation;
+      if (entry->facets_generation == m_db.generation())
+      {
+        if (m_facet_query)
+          m_facet_query->cancel();
+        m_facet_query = nullptr;
+        m_facets = entry->facets;
+      }
+      else
+        reloadFacets();
+      return;
+    }
+    m_cache.erase(key);
+  }
+
+  m_query = live ? std::make_shared<QueryToken>(std::chrono::milliseconds(live_query_budget_ms))
+                 : std::make_shared<QueryToken>();
+  m_executor.submit(
+    [this,
+     token = m_query,
+     key = std::move(key),
+     generation = m_db_generation,
+     raw = ast.raw,
+     sql = SqlFilter::compile(ast)](QueryToken &) mutable {
+      // Only a raw filter can read mem_samples.
+      if (raw)
+        m_db.refresh_sample_store(token.get());
+      auto results = ResultSet::query(m_db, m_executor, std::move(sql), *token);
+      m_executor.post([this, token, key, generation, results = std::move(results)] {
+        if (token != m_query)
+          return;
+        m_query = nullptr;
+        if (results)
+        {
+          m_samples = results;
+          m_samples_key = key;
+          m_cache.put(key, {results, generation, m_attached_generation, {}, 0});
+          reloadFacets();
+        }
+        else
+          m_query_over_budget = !token->cancelled();
+      });
+    },
+    m_query);
 }
 
 auto Ui::playAndClipboardSample() -> void
 {
-  if (m_selected_sample_idx < 0 || m_selected_sample_idx >= static_cast<int>(m_samples_data.size()))
+  if (m_selected_sample_idx < 0)
     return;
-  m_audio_player.play_audio_sample(m_samples_data[m_selected_sample_idx]);
-  ImGui::SetClipboardText(m_samples_data[m_selected_sample_idx].filepath.c_str());
+  const Sample *sample = m_samples->row(m_selected_sample_idx);
+  if (!sample)
+    return;
+  m_audio_player.play_audio_sample(*sample);
+  ImGui::SetClipboardText(sample->filepath.c_str());
+}
+
+void Ui::reloadFacets()
+{
+  if (m_facet_query)
+    m_facet_query->cancel();
+  m_facet_query = std::make_shared<QueryToken>();
+  m_executor.submit(
+    [this,
+     token = m_facet_query,
+     samples = m_samples,
+     generation = m_db.generation(),
+     sql = m_samples->filter()](QueryToken &) {
+      auto facets = m_db.facets(sql, token.get());
+      m_executor.post([this, token, samples, generation, facets = std::move(facets)]() mutable {
+        if (token != m_facet_query)
+          return;
+        m_facet_query = nullptr;
+        if (token->stopped())
+          return;
+        m_facets = std::move(facets);
+        if (auto *entry = m_cache.find(m_samples_key); entry && entry->samples == samples)
+        {
+          entry->facets = m_facets;
+          entry->facets_generation = generation;
+        }
+      });
+    },
+    m_facet_query);
+}
+
+void Ui::startBackup(const std::string &target)
+{
+  m_backup = std::make_shared<QueryToken>();
+  m_backup_copied = 0;
+  m_backup_total = 0;
+  m_executor.submit(
+    [this, token = m_backup, target](QueryToken &) {
+      const bool ok = m_db.backup(target, token.get(), [this](int copied, int total) {
+        m_backup_copied = copied;
+        m_backup_total = total;
+      });
+      m_executor.post([this, token, target, ok] {
+        m_backup = nullptr;
+        m_backup_status = ok                  ? "Backed up to " + target
+                          : token->cancelled() ? std::string{"Backup cancelled"}
+                                               : std::string{"Backup failed, see the log"};
+      });
+    },
+    m_backup);
+}
+
+void Ui::startScan(const std::string &directory)
+{
+  m_scan = std::make_shared<QueryToken>();
+  m_scan_added = 0;
+  // The batches land in the library as they are written; applyChanges() picks
+  // them up like any other write.
+  m_executor.submit(
+    [this, token = m_scan, directory](QueryToken &) {
+      const size_t added =
+        m_db.scan_directory(directory, token.get(), [this](size_t added) { m_scan_added = added; });
+      m_executor.post([this, token, directory, added] {
+        m_scan = nullptr;
+        m_scan_status = token->cancelled()
+                          ? "Scan cancelled after " + std::to_string(added) + " samples"
+                          : "Added " + std::to_string(added) + " samples from " + directory;
+      });
+    },
+    m_scan);
+}
+
+void Ui::startTransfer(bool import, const std::string &path)
+{
+  m_transfer = std::make_shared<QueryToken>();
+  m_transfer_import = import;
+  m_transfer_done = 0;
+  m_transfer_total = 0;
+  m_executor.submit(
+    [this, token = m_transfer, import, path](QueryToken &) {
+      auto progress = [this](size_t done, size_t total) {
+        m_transfer_done = done;
+        m_transfer_total = total;
+      };
+      const bool ok = import ? m_db.import_samples(path, token.get(), progress)
+                             : m_db.export_samples(path, token.get(), progress);
+      m_executor.post([this, token, import, path, ok] {
+        m_transfer = nullptr;
+        const std::string what = import ? "Import" : "Export";
+        const std::string done = import ? "Imported samples from " : "Exported to ";
+        m_transfer_status = ok                  ? done + path
+                            : token->cancelled() ? what + " cancelled"
+                                                 : what + " failed, see the log";
+      });
+    },
+    m_transfer);
+}
+
+void Ui::applyChanges()
+{
+  // A query in flight already sees the writes.
+  if (m_query || m_change_query)
+    return;
+  const auto generation = m_db.generation();
+  if (generation == m_db_generation)
+    return;
+  // Attached libraries have no change log to replay.
+  if (m_db.attached_generation() != m_attached_generation)
+  {
+    reload();
+    return;
+  }
+  m_db_generation = generation;
+  m_change_query = std::make_shared<QueryToken>();
+  m_executor.submit(
+    [this,
+     generation,
+     token = m_change_query,
+     samples = m_samples,
+     seq = m_samples->seq(),
+     sql = m_samples->filter()](QueryToken &) {
+      auto changes = m_db.sample_changes(seq, sql, token.get());
+      m_executor.post([this, generation, token, samples, changes = std::move(changes)] {
+        if (token != m_change_query)
+          return;
+        m_change_query = nullptr;
+        if (token->stopped() || samples != m_samples)
+          return;
+        auto *entry = m_cache.find(m_samples_key);
+        if (!changes.complete)
+        {
+          m_cache.erase(m_samples_key);
+          reload();
+          return;
+        }
+        // Keep the selection on the same sample as rows move around it.
+        const Sample *selected =
+          m_selected_sample_idx >= 0 ? m_samples->row(m_selected_sample_idx) : nullptr;
+        const long long selected_id = selected ? selected->id : 0;
+        m_samples->apply(changes);
+        if (auto idx = selected_id ? m_samples->index_of(selected_id) : std::nullopt)
+          m_selected_sample_idx = static_cast<int>(*idx);
+        if (entry && entry->samples == samples)
+        {
+          // Facets counted for the rows as they were still hold if no sample changed.
+          if (changes.changes.empty() && entry->facets_generation == entry->generation)
+            entry->facets_generation = generation;
+          entry->generation = generation;
+        }
+        if (!changes.changes.empty())
+          reloadFacets();
+      });
+    },
+    m_change_query);
 }
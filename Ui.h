@@ -2,8 +2,15 @@
 
 #include "audio_player.h"
 #include "database.h"
+#include "maintenance.h"
+#include "query_executor.h"
+#include "result_cache.h"
+#include "result_set.h"
 #include "sample.h"
+#include <atomic>
+#include <chrono>
 #include <imgui/imgui.h>
+#include <memory>
 #include <sdlpp/sdlpp.hpp>
 #include <vector>
 
@@ -13,7 +20,6 @@ public:
   Ui(sdl::Window &window,
      SDL_GLContext gl_context,
      Database &db,
-     std::vector<Sample> &samples_data,
      const std::string &initial_filter,
      int initial_selected_sample_idx);
   ~Ui();
@@ -25,15 +31,65 @@ public:
   int getSelectedSampleIdx() const { return m_selected_sample_idx; }
 
 private:
+  static constexpr int live_query_budget_ms = 150;
+  static constexpr int maintenance_idle_ms = 2000; // quiet time before maintenance starts
+
   void extract_metadata_and_insert(const char *filepath);
+  // A live reload runs within the latency budget and gives up past it.
+  void reload(bool live = false);
+  // Catches the list up on writes since it was loaded instead of reloading it.
+  void applyChanges();
+  void reloadFacets();
+  void renderFacets();
+  // Appends a facet's term to the filter and runs it.
+  void refine(const std::string &term);
+  void startBackup(const std::string &target);
+  void startScan(const std::string &directory);
+  // Export or import of the library as a sample stream, see Database::export_samples().
+  void startTransfer(bool import, const std::string &path);
+  void renderSmartFoldersMenu();
+  void renderProfiler();
+  void renderMaintenance();
   auto playAndClipboardSample() -> void;
   sdl::Window &m_window;
   SDL_GLContext m_gl_context;
   Database &m_db;
-  std::vector<Sample> &m_samples_data;
+  std::chrono::steady_clock::time_point m_last_input = std::chrono::steady_clock::now();
+  std::shared_ptr<ResultSet> m_samples;
+  std::string m_samples_key; // normalized filter m_samples is cached under
+  ResultCache m_cache;
+  std::shared_ptr<QueryToken> m_query; // in-flight filter query
+  std::vector<Facet> m_facets;
+  std::vector<SmartFolder> m_smart_folders; // as of the last time the menu opened
+  std::shared_ptr<QueryToken> m_facet_query;
+  std::shared_ptr<QueryToken> m_change_query;
+  unsigned long long m_db_generation = 0;
+  unsigned long long m_attached_generation = 0;
+  std::shared_ptr<QueryToken> m_backup; // running backup
+  std::atomic<int> m_backup_copied = 0; // pages, written by the backup job
+  std::atomic<int> m_backup_total = 0;
+  std::string m_backup_status;
+  std::shared_ptr<QueryToken> m_transfer; // running export or import
+  bool m_transfer_import = false;
+  std::atomic<size_t> m_transfer_done = 0; // samples, written by the transfer job
+  std::atomic<size_t> m_transfer_total = 0;
+  std::string m_transfer_status;
+  std::shared_ptr<QueryToken> m_scan; // running directory scan
+  std::atomic<size_t> m_scan_added = 0; // samples, written by the scan job
+  std::string m_scan_status;
   AudioPlayer m_audio_player;
   bool m_running;
   int m_selected_sample_idx;
   std::string filter;
+  std::vector<std::string> m_filter_errors;
+  std::string m_live_filter;
+  bool m_live_search = true;
+  bool m_query_over_budget = false;
   bool m_scroll_to_selected = false;
+  bool m_show_facets = true;
+  bool m_show_profiler = false;
+  // Last, so the workers are joined before anything their jobs write to, such
+  // as the backup and transfer progress, is destroyed.
+  QueryExecutor m_executor;
+  MaintenanceScheduler m_maintenance{m_db, m_executor};
 };
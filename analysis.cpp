@@ -0,0 +1,224 @@
+#include "analysis.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Blob layout, little-endian throughout:
+//   u8 format, u8 encoding, u32 count
+//   Quantized8/16: f32 smallest, f32 largest, then one u8/u16 per value
+//   Float32: one f32 per value
+//   DeltaVarint: u32 offset of each block of `block_size` values and one past
+//     the last block, counted from the end of the offsets, then the blocks.
+//     A block starts from its first value and goes on with the differences,
+//     all zigzag varints, so a slice only decodes the blocks it falls in.
+static const uint8_t format = 1;
+static const size_t header_size = 6;
+static const size_t block_size = 256;
+
+static void put_u32(std::string &out, uint32_t v)
+{
+  for (int i = 0; i < 4; ++i)
+    out += static_cast<char>(v >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static void put_f32(std::string &out, float v)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &v, sizeof bits);
+  put_u32(out, bits);
+}
+
+static float get_f32(const unsigned char *p)
+{
+  const uint32_t bits = get_u32(p);
+  float v;
+  std::memcpy(&v, &bits, sizeof v);
+  return v;
+}
+
+static void put_varint(std::string &out, long long v)
+{
+  auto zigzag = (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  for (; zigzag >= 0x80; zigzag >>= 7)
+    out += static_cast<char>(zigzag | 0x80);
+  out += static_cast<char>(zigzag);
+}
+
+// Advances `p`; false if the varint runs past `end`.
+static bool get_varint(const unsigned char *&p, const unsigned char *end, long long &v)
+{
+  uint64_t zigzag = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7)
+  {
+    const unsigned char byte = *p++;
+    zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+    {
+      v = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static unsigned quantized_max(AnalysisEncoding encoding)
+{
+  return encoding == AnalysisEncoding::Quantized8 ? 0xff : 0xffff;
+}
+
+std::string encode_analysis(const std::vector<double> &values, AnalysisEncoding encoding)
+{
+  std::string ret;
+  ret += static_cast<char>(format);
+  ret += static_cast<char>(encoding);
+  put_u32(ret, static_cast<uint32_t>(values.size()));
+  switch (encoding)
+  {
+  case AnalysisEncoding::Float32:
+    for (double v : values)
+      put_f32(ret, static_cast<float>(v));
+    break;
+  case AnalysisEncoding::Quantized8:
+  case AnalysisEncoding::Quantized16:
+  {
+    const auto [min, max] = std::minmax_element(values.begin(), values.end());
+    // Quantized against the bounds as stored, so decoding lands on the same steps.
+    const float lo = values.empty() ? 0 : static_cast<float>(*min);
+    const float hi = values.empty() ? 0 : static_cast<float>(*max);
+    put_f32(ret, lo);
+    put_f32(ret, hi);
+    const unsigned steps = quantized_max(encoding);
+    for (double v : values)
+    {
+      const double q = hi > lo ? std::round((v - lo) / (double{hi} - lo) * steps) : 0;
+      const auto step = static_cast<unsigned>(std::clamp(q, 0.0, double(steps)));
+      ret += static_cast<char>(step);
+      if (encoding == AnalysisEncoding::Quantized16)
+        ret += static_cast<char>(step >> 8);
+    }
+    break;
+  }
+  case AnalysisEncoding::DeltaVarint:
+  {
+    const size_t blocks = (values.size() + block_size - 1) / block_size;
+    std::string data;
+    std::string offsets;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+      const auto v = std::llround(values[i]);
+      if (i % block_size == 0)
+      {
+        put_u32(offsets, static_cast<uint32_t>(data.size()));
+        put_varint(data, v);
+      }
+      else
+        put_varint(data, v - std::llround(values[i - 1]));
+    }
+    put_u32(offsets, static_cast<uint32_t>(data.size()));
+    ret.reserve(ret.size() + 4 * (blocks + 1) + data.size());
+    ret += offsets;
+    ret += data;
+    break;
+  }
+  }
+  return ret;
+}
+
+bool read_analysis_header(const AnalysisReader &read, size_t blob_size, AnalysisHeader &header)
+{
+  unsigned char bytes[header_size];
+  if (blob_size < header_size || !read(0, header_size, bytes) || bytes[0] != format ||
+      bytes[1] > static_cast<uint8_t>(AnalysisEncoding::DeltaVarint))
+    return false;
+  header.encoding = static_cast<AnalysisEncoding>(bytes[1]);
+  header.count = get_u32(bytes + 2);
+  return true;
+}
+
+bool decode_analysis(const AnalysisReader &read,
+                     size_t blob_size,
+                     size_t first,
+                     size_t count,
+                     std::vector<double> &out)
+{
+  out.clear();
+  AnalysisHeader header;
+  if (!read_analysis_header(read, blob_size, header))
+    return false;
+  if (first >= header.count)
+    return true;
+  count = std::min(count, header.count - first);
+  if (count == 0)
+    return true;
+
+  std::vector<unsigned char> bytes;
+  // Reads [offset, offset + size), which has to lie inside the blob.
+  auto fetch = [&](size_t offset, size_t size) {
+    if (offset > blob_size || size > blob_size - offset)
+      return false;
+    bytes.resize(size);
+    return read(offset, size, bytes.data());
+  };
+  out.reserve(count);
+  switch (header.encoding)
+  {
+  case AnalysisEncoding::Float32:
+    if (!fetch(header_size + 4 * first, 4 * count))
+      return false;
+    for (size_t i = 0; i < count; ++i)
+      out.push_back(get_f32(bytes.data() + 4 * i));
+    return true;
+  case AnalysisEncoding::Quantized8:
+  case AnalysisEncoding::Quantized16:
+  {
+    if (!fetch(header_size, 8))
+      return false;
+    const float lo = get_f32(bytes.data());
+    const float hi = get_f32(bytes.data() + 4);
+    const double step = (double{hi} - lo) / quantized_max(header.encoding);
+    const size_t width = header.encoding == AnalysisEncoding::Quantized8 ? 1 : 2;
+    if (!fetch(header_size + 8 + width * first, width * count))
+      return false;
+    for (size_t i = 0; i < count; ++i)
+    {
+      const unsigned q = width == 1 ? bytes[i] : bytes[2 * i] | bytes[2 * i + 1] << 8;
+      out.push_back(lo + q * step);
+    }
+    return true;
+  }
+  case AnalysisEncoding::DeltaVarint:
+  {
+    const size_t blocks = (header.count + block_size - 1) / block_size;
+    const size_t data_start = header_size + 4 * (blocks + 1);
+    const size_t first_block = first / block_size;
+    const size_t end_block = (first + count - 1) / block_size + 1;
+    if (!fetch(header_size + 4 * first_block, 4))
+      return false;
+    const uint32_t begin = get_u32(bytes.data());
+    if (!fetch(header_size + 4 * end_block, 4))
+      return false;
+    const uint32_t end = get_u32(bytes.data());
+    if (end < begin || !fetch(data_start + begin, end - begin))
+      return false;
+    const unsigned char *p = bytes.data();
+    const unsigned char *p_end = p + bytes.size();
+    long long v = 0;
+    for (size_t i = first_block * block_size; out.size() < count; ++i)
+    {
+      long long delta;
+      if (!get_varint(p, p_end, delta))
+        return false;
+      v = i % block_size == 0 ? delta : v + delta;
+      if (i >= first)
+        out.push_back(static_cast<double>(v));
+    }
+    return true;
+  }
+  }
+  return false;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Per-sample analysis results, stored apart from the sample rows as one blob
+// per sample and kind.
+enum class AnalysisKind
+{
+  Peaks = 1,       // waveform overview
+  Features = 2,    // descriptors such as loudness or spectral centroid
+  Fingerprint = 3, // acoustic fingerprint words
+};
+
+// How the values of a blob are stored. Every encoding can be read from any
+// position without decoding what comes before.
+enum class AnalysisEncoding : uint8_t
+{
+  Float32,     // exact floats, 4 bytes a value
+  Quantized8,  // 1 byte a value, spread evenly between the smallest and largest
+  Quantized16, // 2 bytes a value, likewise
+  DeltaVarint, // whole numbers as differences to the previous one, in varints
+};
+
+// The fixed part at the start of every blob.
+struct AnalysisHeader
+{
+  AnalysisEncoding encoding = AnalysisEncoding::Float32;
+  uint32_t count = 0; // values in the blob
+};
+
+// Reads `size` bytes at `offset` of a blob into `out`; false on failure.
+using AnalysisReader = std::function<bool(size_t offset, size_t size, void *out)>;
+
+// The blob for the values. DeltaVarint rounds them to whole numbers, which it
+// keeps exactly up to 2^53.
+std::string encode_analysis(const std::vector<double> &values, AnalysisEncoding encoding);
+// Reads the header; false if the blob is not one encode_analysis() wrote.
+bool read_analysis_header(const AnalysisReader &read, size_t blob_size, AnalysisHeader &header);
+// Values [first, first + count) into `out`, cut short at the end of the blob,
+// reading only the bytes that hold them. False if the blob is damaged.
+bool decode_analysis(const AnalysisReader &read,
+                     size_t blob_size,
+                     size_t first,
+                     size_t count,
+                     std::vector<double> &out);
@@ -1,8 +1,22 @@
 #include "database.h"
 #include "audio_player.h"
+#include "natural_sort.h"
+#include "sql_record.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <log/log.hpp>
+#include <msgpack/msgpack-ser.hpp>
 #include <regex.h>
+#include <ser/macro.hpp>
+#include <set>
+#include <string_view>
+#include <tuple>
+#include <unordered_set>
 
 static void regexp(sqlite3_context *context, int /*argc*/, sqlite3_value **argv) {
     const char *pattern = (const char *)sqlite3_value_text(argv[0]);
@@ -28,23 +42,270 @@ static void regexp(sqlite3_context *context, int /*argc*/, sqlite3_value **argv)
     sqlite3_result_int(context, (ret == 0));
 }
 
-Database::Database(const std::string &db_path)
+static void natural_key_function(sqlite3_context *context, int /*argc*/, sqlite3_value **argv)
 {
-  int rc = sqlite3_open(db_path.c_str(), &db_);
+  const auto *text = reinterpret_cast<const char *>(sqlite3_value_text(argv[0]));
+  if (!text)
+  {
+    sqlite3_result_null(context);
+    return;
+  }
+  const auto key = natural_key({text, static_cast<size_t>(sqlite3_value_bytes(argv[0]))});
+  sqlite3_result_blob(context, key.data(), static_cast<int>(key.size()), SQLITE_TRANSIENT);
+}
+
+static int natural_collation(void * /*arg*/, int a_size, const void *a, int b_size, const void *b)
+{
+  return natural_compare({static_cast<const char *>(a), static_cast<size_t>(a_size)},
+                         {static_cast<const char *>(b), static_cast<size_t>(b_size)});
+}
+
+// path_dir(), path_basename() and path_ext(): the directory with its trailing
+// separator, the file name, and the lower-case extension without the dot ('' if
+// there is none). Deterministic, so they can back expression indexes.
+enum class PathPart
+{
+  Dir,
+  Basename,
+  Ext
+};
+
+static void path_function(sqlite3_context *context, int /*argc*/, sqlite3_value **argv)
+{
+  const auto *text = reinterpret_cast<const char *>(sqlite3_value_text(argv[0]));
+  if (!text)
+  {
+    sqlite3_result_null(context);
+    return;
+  }
+  const std::string_view path{text, static_cast<size_t>(sqlite3_value_bytes(argv[0]))};
+  const auto name_pos = path.rfind('/') + 1; // 0 without a separator
+  std::string ret;
+  switch (*static_cast<const PathPart *>(sqlite3_user_data(context)))
+  {
+  case PathPart::Dir:
+    ret = path.substr(0, name_pos);
+    break;
+  case PathPart::Basename:
+    ret = path.substr(name_pos);
+    break;
+  case PathPart::Ext:
+    if (const auto dot = path.rfind('.'); dot != std::string_view::npos && dot >= name_pos)
+      for (char c : path.substr(dot + 1))
+        ret += c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    break;
+  }
+  sqlite3_result_text(context, ret.data(), static_cast<int>(ret.size()), SQLITE_TRANSIENT);
+}
+
+static sqlite3 *open_database(const std::string &db_path, int flags, int busy_timeout_ms)
+{
+  sqlite3 *db = nullptr;
+  // Every connection is used by one thread at a time, the pool and the write
+  // mutex take care of that, so SQLite's own per-connection mutex is skipped.
+  // URIs are for attaching other libraries read-only.
+  int rc = sqlite3_open_v2(
+    db_path.c_str(), &db, flags | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, nullptr);
   if (rc)
   {
-    LOG("Can't open database:", sqlite3_errmsg(db_));
+    LOG("Can't open database:", sqlite3_errmsg(db));
+    sqlite3_close(db);
     throw std::runtime_error("Failed to open database");
   }
   else
   {
     LOG("Opened database successfully");
   }
+  sqlite3_busy_timeout(db, busy_timeout_ms);
 
   // Register "REGEXP" function
-  sqlite3_create_function(db_, "REGEXP", 2, SQLITE_UTF8, NULL, &regexp, NULL, NULL);
+  sqlite3_create_function(db, "REGEXP", 2, SQLITE_UTF8, NULL, &regexp, NULL, NULL);
+  static const PathPart path_parts[] = {PathPart::Dir, PathPart::Basename, PathPart::Ext};
+  static const char *path_names[] = {"path_dir", "path_basename", "path_ext"};
+  for (int i = 0; i < 3; ++i)
+    sqlite3_create_function(db,
+                            path_names[i],
+                            1,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+                            const_cast<PathPart *>(&path_parts[i]),
+                            &path_function,
+                            nullptr,
+                            nullptr);
+  // Natural order for raw SQL, as "ORDER BY name COLLATE NATURAL" or through
+  // the stored keys. The keys are written by the app, not by triggers.
+  sqlite3_create_function(db,
+                          "natural_key",
+                          1,
+                          SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                          nullptr,
+                          &natural_key_function,
+                          nullptr,
+                          nullptr);
+  sqlite3_create_collation(db, "NATURAL", SQLITE_UTF8, nullptr, &natural_collation);
+  return db;
+}
+
+// Version migrate() brings the main library to. Attached libraries have to be
+// at it already.
+static const int schema_version = 11;
+
+// Schema an attached library goes by; 0 is the main one.
+static std::string schema_name(size_t library)
+{
+  return library ? "lib" + std::to_string(library) : std::string{"main"};
+}
+
+static long long data_version(Connection &conn, const std::string &schema)
+{
+  auto stmt = conn.stmts.get("PRAGMA " + schema + ".data_version;");
+  return stmt && sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+}
+
+static const char *sample_columns =
+  "ID, filepath, size, duration, samplerate, bitdepth, channels, tags";
+
+static std::string column_text(sqlite3_stmt *stmt, int col)
+{
+  auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+  return text ? text : "";
+}
+
+// Reads the sample_columns starting at column `col`.
+static Sample read_sample(sqlite3_stmt *stmt, int col = 0)
+{
+  Sample s;
+  read_record(stmt, s, col);
+  return s;
+}
+
+// A row of sample_files as insert_rows() writes it; the fields carry the column names.
+struct SampleFileRow
+{
+  long long dir_id = 0;
+  std::string name;
+  long long size = 0;
+  double duration = 0;
+  int samplerate = 0;
+  int bitdepth = 0;
+  int channels = 0;
+  std::string tags;
+  SqlBlob name_key;
+  SER_PROPS(dir_id, name, size, duration, samplerate, bitdepth, channels, tags, name_key);
+};
+
+static std::vector<std::string> split_tags(const std::string &tags)
+{
+  std::vector<std::string> ret;
+  size_t pos = 0;
+  while (pos <= tags.size())
+  {
+    auto end = std::min(tags.find(',', pos), tags.size());
+    auto first = tags.find_first_not_of(" \t", pos);
+    auto last = tags.find_last_not_of(" \t", end - 1);
+    if (first < end && last != std::string::npos && last >= first)
+      ret.push_back(tags.substr(first, last - first + 1));
+    pos = end + 1;
+  }
+  return ret;
+}
+
+static bool run(Connection &conn, const std::string &sql)
+{
+  auto stmt = conn.stmts.get(sql);
+  if (!stmt)
+    return false;
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW)
+  {
+    LOG("SQL error:", sqlite3_errmsg(conn.db), sql);
+    return false;
+  }
+  return true;
+}
+
+static int bind_params(sqlite3_stmt *stmt, const std::vector<SqlValue> &params, int idx = 1)
+{
+  for (const auto &param : params)
+  {
+    if (auto v = std::get_if<long long>(&param))
+      sqlite3_bind_int64(stmt, idx++, *v);
+    else if (auto v = std::get_if<double>(&param))
+      sqlite3_bind_double(stmt, idx++, *v);
+    else
+    {
+      const auto &text = std::get<std::string>(param);
+      sqlite3_bind_text(stmt, idx++, text.data(), static_cast<int>(text.size()), SQLITE_STATIC);
+    }
+  }
+  return idx;
+}
 
+static void bind_blob(sqlite3_stmt *stmt, int idx, const std::string &value)
+{
+  sqlite3_bind_blob(stmt, idx, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT);
+}
+
+// Natural key of a directory path. The path itself follows after a NUL, which
+// sorts before anything a key can continue with, so directories that only
+// differ in case still get distinct keys and each one's files stay together.
+static std::string dir_sort_key(const std::string &path)
+{
+  return natural_key(path) + '\0' + path;
+}
+
+// Parent and name of a directory path with its trailing separator: "/a/b/" is
+// "b" under "/a/". "/" and "" have no parent and get an empty one.
+static std::pair<std::string, std::string> split_dir(const std::string &path)
+{
+  const auto trimmed = path.empty() ? path : path.substr(0, path.size() - 1);
+  const auto sep = trimmed.rfind('/');
+  if (sep == std::string::npos)
+    return {"", trimmed};
+  return {trimmed.substr(0, sep + 1), trimmed.substr(sep + 1)};
+}
+
+static bool exec(sqlite3 *db, const std::string &sql)
+{
   char *zErrMsg = 0;
+  int rc = sqlite3_exec(db, sql.c_str(), 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK)
+  {
+    LOG("SQL error:", zErrMsg, sql);
+    sqlite3_free(zErrMsg);
+    return false;
+  }
+  return true;
+}
+
+Database::Database(const std::string &db_path, Options options)
+  : path_(db_path),
+    options_(options),
+    profiler_(options.slow_query_ms, options.slow_query_history),
+    writer_(open_database(
+      db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, options.busy_timeout_ms))
+{
+  profiler_.attach(writer_);
+  sample_store_.attach(writer_.db);
+  // Only takes on a new, empty file, so it comes before the switch to WAL.
+  // Existing databases keep their mode and idle maintenance skips the
+  // incremental vacuum for them.
+  exec(writer_.db, "PRAGMA auto_vacuum=INCREMENTAL;");
+  // WAL lets readers keep their snapshot while the writer appends, so scans
+  // and tag edits no longer block queries. The mode is persistent in the file.
+  {
+    auto stmt = writer_.stmts.get("PRAGMA journal_mode=WAL;");
+    const char *mode = stmt && sqlite3_step(stmt) == SQLITE_ROW
+                         ? reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0))
+                         : nullptr;
+    if (!mode || std::string{mode} != "wal")
+      LOG("Could not switch database to WAL mode, reads and writes will block each other");
+  }
+  const char *synchronous[] = {"OFF", "NORMAL", "FULL"};
+  exec(writer_.db,
+       std::string{"PRAGMA synchronous="} + synchronous[static_cast<int>(options_.synchronous)] +
+         ";PRAGMA wal_autocheckpoint=" + std::to_string(options_.wal_autocheckpoint) +
+         ";PRAGMA journal_size_limit=" + std::to_string(options_.journal_size_limit) + ";");
+
   const char *sql = "CREATE TABLE IF NOT EXISTS samples ("
                     "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
                     "filepath TEXT NOT NULL,"
@@ -55,99 +316,2066 @@ Database::Database(const std::string &db_path)
                     "channels INT NOT NULL,"
                     "tags TEXT);";
 
-  rc = sqlite3_exec(db_, sql, 0, 0, &zErrMsg);
-  if (rc != SQLITE_OK)
+  if (!exec(writer_.db, sql))
   {
-    LOG("SQL error:", zErrMsg);
-    sqlite3_free(zErrMsg);
     throw std::runtime_error("Failed to create table");
   }
   else
   {
     LOG("Table created successfully");
   }
+
+  migrate();
+  // Smart folders catch up on writes made without them, such as by other
+  // tools, before pruning takes the log they need.
+  if (exec(writer_.db, "BEGIN IMMEDIATE;"))
+    exec(writer_.db, update_smart_folders() ? "COMMIT;" : "ROLLBACK;");
+  // Lists further behind than this reload instead of replaying the log.
+  if (auto stmt = writer_.stmts.get(
+        "DELETE FROM sample_changes WHERE seq <= (SELECT max(seq) FROM sample_changes) - ?;"))
+  {
+    sqlite3_bind_int64(stmt, 1, options_.change_log_size);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+      LOG("SQL error pruning the change log:", sqlite3_errmsg(writer_.db));
+  }
+  writer_idle();
+
+  // A library that cannot be attached is left out rather than failing the
+  // whole app, so the readers only attach the ones the writer could.
+  for (const auto &library : options_.libraries)
+    if (attach_library(writer_.db, library, libraries_.size() + 1))
+      libraries_.push_back(library);
+  for (size_t i = 0; i < libraries_.size(); ++i)
+    attached_versions_.push_back(data_version(writer_, schema_name(i + 1)));
+
+  for (int i = 0; i < std::max(1, options_.read_connections); ++i)
+  {
+    auto reader = std::make_unique<Connection>(
+      open_database(db_path, SQLITE_OPEN_READONLY, options_.busy_timeout_ms));
+    profiler_.attach(*reader);
+    sample_store_.attach(reader->db);
+    for (size_t j = 0; j < libraries_.size(); ++j)
+      attach_library(reader->db, libraries_[j], j + 1);
+    readers_.add(std::move(reader));
+  }
+}
+
+static int user_version(sqlite3 *db, const std::string &schema = "main")
+{
+  sqlite3_stmt *stmt = nullptr;
+  int version = 0;
+  const auto sql = "PRAGMA " + schema + ".user_version;";
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return version;
+}
+
+// Schema changes on top of the samples table, keyed by PRAGMA user_version.
+void Database::migrate()
+{
+  const int version = user_version(writer_.db);
+  if (version >= schema_version)
+    return;
+
+  LOG("Migrating database from version", version);
+  if (!exec(writer_.db, "BEGIN IMMEDIATE;"))
+    throw std::runtime_error("Failed to migrate database");
+  bool ok = true;
+  if (version < 1)
+  {
+    // Structured filters: FTS over path and tags, a tag index and indexes for
+    // the numeric fields.
+    ok = ok && exec(writer_.db,
+                    "CREATE INDEX IF NOT EXISTS samples_filepath ON samples(filepath);"
+                    "CREATE INDEX IF NOT EXISTS samples_duration ON samples(duration);"
+                    "CREATE INDEX IF NOT EXISTS samples_samplerate ON samples(samplerate);"
+                    "CREATE INDEX IF NOT EXISTS samples_size ON samples(size);"
+                    "CREATE VIRTUAL TABLE samples_fts USING fts5("
+                    "  filepath, tags, content='samples', content_rowid='ID');"
+                    "CREATE TRIGGER samples_fts_ai AFTER INSERT ON samples BEGIN"
+                    "  INSERT INTO samples_fts(rowid, filepath, tags)"
+                    "    VALUES (new.ID, new.filepath, new.tags);"
+                    "END;"
+                    "CREATE TRIGGER samples_fts_ad AFTER DELETE ON samples BEGIN"
+                    "  INSERT INTO samples_fts(samples_fts, rowid, filepath, tags)"
+                    "    VALUES ('delete', old.ID, old.filepath, old.tags);"
+                    "END;"
+                    "CREATE TRIGGER samples_fts_au AFTER UPDATE OF filepath, tags ON samples BEGIN"
+                    "  INSERT INTO samples_fts(samples_fts, rowid, filepath, tags)"
+                    "    VALUES ('delete', old.ID, old.filepath, old.tags);"
+                    "  INSERT INTO samples_fts(rowid, filepath, tags)"
+                    "    VALUES (new.ID, new.filepath, new.tags);"
+                    "END;"
+                    "INSERT INTO samples_fts(samples_fts) VALUES ('rebuild');"
+                    "CREATE TABLE sample_tags ("
+                    "  tag TEXT NOT NULL COLLATE NOCASE,"
+                    "  sample_id INTEGER NOT NULL,"
+                    "  PRIMARY KEY (tag, sample_id)) WITHOUT ROWID;"
+                    "CREATE INDEX sample_tags_sample ON sample_tags(sample_id);"
+                    "CREATE TRIGGER sample_tags_ad AFTER DELETE ON samples BEGIN"
+                    "  DELETE FROM sample_tags WHERE sample_id = old.ID;"
+                    "END;");
+    std::vector<std::pair<long long, std::string>> tagged;
+    if (auto stmt = writer_.stmts.get("SELECT ID, tags FROM samples WHERE tags <> '';"))
+      while (sqlite3_step(stmt) == SQLITE_ROW)
+        tagged.emplace_back(sqlite3_column_int64(stmt, 0), column_text(stmt, 1));
+    for (const auto &[id, tags] : tagged)
+      insert_tags(id, tags);
+  }
+  if (version < 2)
+    ok = ok && migrate_facets();
+  if (version < 3)
+    ok = ok && migrate_change_log();
+  if (version < 4)
+    ok = ok && migrate_directories();
+  if (version < 5)
+    ok = ok && migrate_sort_keys();
+  if (version < 6)
+    ok = ok && migrate_ranges();
+  if (version < 7)
+    ok = ok && migrate_path_functions();
+  if (version < 8)
+    ok = ok && migrate_analysis();
+  if (version < 9)
+    ok = ok && migrate_smart_folders();
+  if (version < 10)
+    ok = ok && migrate_library_id();
+  if (version < 11)
+    ok = ok && migrate_write_count();
+  if (!ok ||
+      !exec(writer_.db, "PRAGMA user_version = " + std::to_string(schema_version) + "; COMMIT;"))
+  {
+    exec(writer_.db, "ROLLBACK;");
+    throw std::runtime_error("Failed to migrate database");
+  }
+}
+
+static std::string facet_increment(const std::string &values)
+{
+  return "INSERT INTO facet_counts (facet, value, count) VALUES " + values +
+         " ON CONFLICT (facet, value) DO UPDATE SET count = count + 1;";
+}
+
+static std::string facet_decrement(const std::string &values)
+{
+  return "UPDATE facet_counts SET count = count - 1 WHERE (facet, value) IN (VALUES " + values +
+         ");";
+}
+
+// Triggers keeping the facet_counts of a sample table current. `folder` gives
+// the parent directory of a row, given "new" or "old".
+static std::string facet_triggers(const std::string &table,
+                                  const std::string &update_columns,
+                                  const std::function<std::string(const std::string &)> &folder)
+{
+  using F = FacetBuilder;
+  // The (facet, value) pairs a row counts towards, with `extra` appended to
+  // each tuple.
+  auto sample_values = [&](const std::string &row, const std::string &extra = "") {
+    return "('" + std::string{F::key(F::SampleRate)} + "', " + row + ".samplerate" + extra +
+           "), ('" + F::key(F::Channels) + "', " + row + ".channels" + extra + "), ('" +
+           F::key(F::BitDepth) + "', " + row + ".bitdepth" + extra + "), ('" +
+           F::key(F::Duration) + "', " + F::duration_sql(row + ".duration") + extra + "), ('" +
+           F::key(F::Folder) + "', " + folder(row) + extra + ")";
+  };
+  return "CREATE TRIGGER facet_counts_ai AFTER INSERT ON " + table + " BEGIN " +
+         facet_increment(sample_values("new", ", 1")) +
+         " END;"
+         "CREATE TRIGGER facet_counts_ad AFTER DELETE ON " +
+         table + " BEGIN " + facet_decrement(sample_values("old")) +
+         " END;"
+         "CREATE TRIGGER facet_counts_au AFTER UPDATE OF " +
+         update_columns + " ON " + table + " BEGIN " + facet_decrement(sample_values("old")) +
+         " " + facet_increment(sample_values("new", ", 1")) + " END;";
+}
+
+// Facet totals for the whole library, kept current by triggers so the
+// unfiltered sidebar is a read of a few hundred rows. Counts that drop to zero
+// stay behind and are skipped on read.
+bool Database::migrate_facets()
+{
+  using F = FacetBuilder;
+  const std::string tag_key = F::key(F::Tag);
+  const std::string sql =
+    "CREATE TABLE facet_counts ("
+    "  facet TEXT NOT NULL,"
+    "  value NOT NULL,"
+    "  count INTEGER NOT NULL,"
+    "  PRIMARY KEY (facet, value)) WITHOUT ROWID;" +
+    facet_triggers("samples",
+                   "filepath, duration, samplerate, bitdepth, channels",
+                   [](const std::string &row) { return F::folder_sql(row + ".filepath"); }) +
+    "CREATE TRIGGER facet_counts_tag_ai AFTER INSERT ON sample_tags BEGIN " +
+    facet_increment("('" + tag_key + "', lower(new.tag), 1)") +
+    " END;"
+    "CREATE TRIGGER facet_counts_tag_ad AFTER DELETE ON sample_tags BEGIN " +
+    facet_decrement("('" + tag_key + "', lower(old.tag))") +
+    " END;"
+    "INSERT INTO facet_counts (facet, value, count)"
+    "  SELECT '" +
+    tag_key + "', lower(tag), COUNT(*) FROM sample_tags GROUP BY 2;";
+  if (!exec(writer_.db, sql))
+    return false;
+
+  const std::pair<F::Field, std::string> columns[] = {
+    {F::SampleRate, "samplerate"},
+    {F::Channels, "channels"},
+    {F::BitDepth, "bitdepth"},
+    {F::Duration, F::duration_sql("duration")},
+    {F::Folder, F::folder_sql("filepath")},
+  };
+  for (const auto &[field, expr] : columns)
+    if (!exec(writer_.db,
+              std::string{"INSERT INTO facet_counts (facet, value, count) SELECT '"} +
+                F::key(field) + "', " + expr + ", COUNT(*) FROM samples GROUP BY 2;"))
+      return false;
+  return true;
+}
+
+// Every write to samples leaves its sample ID and old sort key here, so open
+// result lists can catch up on just what changed. AUTOINCREMENT keeps
+// sequence numbers from being reused after pruning.
+bool Database::migrate_change_log()
+{
+  return exec(writer_.db,
+              "CREATE TABLE sample_changes ("
+              "  seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+              "  sample_id INTEGER NOT NULL,"
+              "  old_filepath TEXT);"
+              "CREATE TRIGGER sample_changes_ai AFTER INSERT ON samples BEGIN"
+              "  INSERT INTO sample_changes (sample_id) VALUES (new.ID);"
+              "END;"
+              "CREATE TRIGGER sample_changes_au AFTER UPDATE ON samples BEGIN"
+              "  INSERT INTO sample_changes (sample_id, old_filepath) VALUES (new.ID, old.filepath);"
+              "END;"
+              "CREATE TRIGGER sample_changes_ad AFTER DELETE ON samples BEGIN"
+              "  INSERT INTO sample_changes (sample_id, old_filepath) VALUES (old.ID, old.filepath);"
+              "END;");
+}
+
+// Each directory path is stored once: sample_files keeps a directory ID and
+// the file name, and samples becomes a view that joins the path back, so
+// filters and raw SQL still see a filepath column. Display order is (dir_path,
+// name, ID), which walking directories by path and sample_files by (dir_id,
+// name) produces without a sort, and a directory subtree is a range of paths.
+bool Database::migrate_directories()
+{
+  if (!exec(writer_.db,
+            "CREATE TABLE directories ("
+            "  id INTEGER PRIMARY KEY,"
+            "  parent_id INTEGER REFERENCES directories(id),"
+            "  name TEXT NOT NULL,"
+            "  path TEXT NOT NULL UNIQUE);" // with the trailing separator
+            "CREATE INDEX directories_parent ON directories(parent_id, name);"
+            "CREATE TABLE sample_files ("
+            "  ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "  dir_id INTEGER NOT NULL REFERENCES directories(id),"
+            "  name TEXT NOT NULL,"
+            "  size INT NOT NULL,"
+            "  duration REAL NOT NULL,"
+            "  samplerate INT NOT NULL,"
+            "  bitdepth INT NOT NULL,"
+            "  channels INT NOT NULL,"
+            "  tags TEXT);"))
+    return false;
+
+  // Every directory along with its parents, which sort before it. The rows go
+  // in without directory_id(), whose sort_key only comes with the next version;
+  // migrate_sort_keys() fills it in.
+  std::set<std::string> dirs;
+  if (auto stmt =
+        writer_.stmts.get("SELECT DISTINCT " + FacetBuilder::folder_sql("filepath") + " FROM samples;"))
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      for (auto dir = column_text(stmt, 0); dirs.insert(dir).second;)
+      {
+        dir = split_dir(dir).first;
+        if (dir.empty())
+          break;
+      }
+  auto insert =
+    writer_.stmts.get("INSERT INTO directories (parent_id, name, path) VALUES (?, ?, ?);");
+  if (!insert)
+    return false;
+  std::unordered_map<std::string, long long> ids;
+  for (const auto &dir : dirs)
+  {
+    const auto [parent, name] = split_dir(dir);
+    if (!parent.empty())
+      sqlite3_bind_int64(insert, 1, ids.at(parent));
+    else
+      sqlite3_bind_null(insert, 1);
+    sqlite3_bind_text(insert, 2, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert, 3, dir.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(insert) != SQLITE_DONE)
+    {
+      LOG("SQL error inserting directory:", sqlite3_errmsg(writer_.db));
+      return false;
+    }
+    sqlite3_reset(insert);
+    ids.emplace(dir, sqlite3_last_insert_rowid(writer_.db));
+  }
+
+  auto path_of = [](const std::string &row) {
+    return "(SELECT path FROM directories WHERE id = " + row + ".dir_id)";
+  };
+  auto filepath_of = [&](const std::string &row) { return path_of(row) + " || " + row + ".name"; };
+  // Dropping samples takes its indexes and triggers along; they are recreated
+  // on sample_files, and its AUTOINCREMENT carries on from the old table's.
+  return exec(writer_.db,
+              "INSERT INTO sample_files"
+              "  (ID, dir_id, name, size, duration, samplerate, bitdepth, channels, tags)"
+              "  SELECT s.ID, d.id, substr(s.filepath, length(d.path) + 1), s.size, s.duration,"
+              "    s.samplerate, s.bitdepth, s.channels, s.tags"
+              "  FROM samples s JOIN directories d ON d.path = " +
+                FacetBuilder::folder_sql("s.filepath") +
+                ";"
+                "DELETE FROM sqlite_sequence WHERE name = 'sample_files';"
+                "UPDATE sqlite_sequence SET name = 'sample_files' WHERE name = 'samples';"
+                "DROP TABLE samples;"
+                "CREATE INDEX sample_files_dir ON sample_files(dir_id, name);"
+                "CREATE INDEX sample_files_duration ON sample_files(duration);"
+                "CREATE INDEX sample_files_samplerate ON sample_files(samplerate);"
+                "CREATE INDEX sample_files_size ON sample_files(size);"
+                "CREATE VIEW samples AS SELECT"
+                "  s.ID AS ID, d.path || s.name AS filepath, s.size AS size, s.duration AS duration,"
+                "  s.samplerate AS samplerate, s.bitdepth AS bitdepth, s.channels AS channels,"
+                "  s.tags AS tags, s.dir_id AS dir_id, d.path AS dir_path, s.name AS name"
+                "  FROM sample_files s JOIN directories d ON d.id = s.dir_id;"
+                "CREATE TRIGGER samples_fts_ai AFTER INSERT ON sample_files BEGIN"
+                "  INSERT INTO samples_fts(rowid, filepath, tags)"
+                "    VALUES (new.ID, " +
+                filepath_of("new") +
+                ", new.tags);"
+                "END;"
+                "CREATE TRIGGER samples_fts_ad AFTER DELETE ON sample_files BEGIN"
+                "  INSERT INTO samples_fts(samples_fts, rowid, filepath, tags)"
+                "    VALUES ('delete', old.ID, " +
+                filepath_of("old") +
+                ", old.tags);"
+                "END;"
+                "CREATE TRIGGER samples_fts_au AFTER UPDATE OF dir_id, name, tags ON sample_files BEGIN"
+                "  INSERT INTO samples_fts(samples_fts, rowid, filepath, tags)"
+                "    VALUES ('delete', old.ID, " +
+                filepath_of("old") +
+                ", old.tags);"
+                "  INSERT INTO samples_fts(rowid, filepath, tags)"
+                "    VALUES (new.ID, " +
+                filepath_of("new") +
+                ", new.tags);"
+                "END;"
+                "CREATE TRIGGER sample_tags_ad AFTER DELETE ON sample_files BEGIN"
+                "  DELETE FROM sample_tags WHERE sample_id = old.ID;"
+                "END;" +
+                facet_triggers("sample_files",
+                               "dir_id, duration, samplerate, bitdepth, channels",
+                               path_of) +
+                "CREATE TRIGGER sample_changes_ai AFTER INSERT ON sample_files BEGIN"
+                "  INSERT INTO sample_changes (sample_id) VALUES (new.ID);"
+                "END;"
+                "CREATE TRIGGER sample_changes_au AFTER UPDATE ON sample_files BEGIN"
+                "  INSERT INTO sample_changes (sample_id, old_filepath) VALUES (new.ID, " +
+                filepath_of("old") +
+                ");"
+                "END;"
+                "CREATE TRIGGER sample_changes_ad AFTER DELETE ON sample_files BEGIN"
+                "  INSERT INTO sample_changes (sample_id, old_filepath) VALUES (old.ID, " +
+                filepath_of("old") +
+                ");"
+                "END;");
+}
+
+// Natural order through stored keys: directories.sort_key over the path and
+// sample_files.name_key over the name, written along with the rows. Display
+// order becomes (dir_key, name_key, ID), still an index walk with no sort and
+// no collation callback per comparison.
+bool Database::migrate_sort_keys()
+{
+  if (!exec(writer_.db,
+            "ALTER TABLE directories ADD COLUMN sort_key BLOB NOT NULL DEFAULT x'';"
+            "ALTER TABLE sample_files ADD COLUMN name_key BLOB NOT NULL DEFAULT x'';"
+            "UPDATE sample_files SET name_key = natural_key(name);"))
+    return false;
+  std::vector<std::pair<long long, std::string>> dirs;
+  if (auto stmt = writer_.stmts.get("SELECT id, path FROM directories;"))
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      dirs.emplace_back(sqlite3_column_int64(stmt, 0), column_text(stmt, 1));
+  auto stmt = writer_.stmts.get("UPDATE directories SET sort_key = ? WHERE id = ?;");
+  if (!stmt)
+    return false;
+  for (const auto &[id, path] : dirs)
+  {
+    bind_blob(stmt, 1, dir_sort_key(path));
+    sqlite3_bind_int64(stmt, 2, id);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+      return false;
+    sqlite3_reset(stmt);
+  }
+  return exec(writer_.db,
+              "CREATE UNIQUE INDEX directories_sort ON directories(sort_key);"
+              "DROP INDEX sample_files_dir;"
+              "CREATE INDEX sample_files_dir ON sample_files(dir_id, name_key);"
+              "DROP VIEW samples;"
+              "CREATE VIEW samples AS SELECT"
+              "  s.ID AS ID, d.path || s.name AS filepath, s.size AS size, s.duration AS duration,"
+              "  s.samplerate AS samplerate, s.bitdepth AS bitdepth, s.channels AS channels,"
+              "  s.tags AS tags, s.dir_id AS dir_id, d.path AS dir_path, s.name AS name,"
+              "  d.sort_key AS dir_key, s.name_key AS name_key"
+              "  FROM sample_files s JOIN directories d ON d.id = s.dir_id;");
+}
+
+// An R*Tree over the numeric fields, one point per sample, for filters that
+// constrain several of them at once (see SqlFilter::compile()). R*Tree
+// coordinates are 32-bit floats; SQLite rounds the bounds outwards, so the
+// point always lies inside its box.
+bool Database::migrate_ranges()
+{
+  static const char *columns[] = {"duration", "samplerate", "bitdepth", "channels", "size"};
+  auto values = [](const std::string &row) {
+    std::string ret = row + ".ID";
+    for (const char *column : columns)
+      ret += ", " + row + "." + column + ", " + row + "." + column;
+    return ret;
+  };
+  std::string defs;
+  for (const char *column : columns)
+    defs += std::string{", "} + column + "_lo, " + column + "_hi";
+  return exec(writer_.db,
+              "CREATE VIRTUAL TABLE sample_ranges USING rtree(id" + defs +
+                ");"
+                "INSERT INTO sample_ranges SELECT " +
+                values("s") +
+                " FROM sample_files s;"
+                "CREATE TRIGGER sample_ranges_ai AFTER INSERT ON sample_files BEGIN"
+                "  INSERT INTO sample_ranges VALUES (" +
+                values("new") +
+                ");"
+                "END;"
+                "CREATE TRIGGER sample_ranges_au"
+                "  AFTER UPDATE OF duration, samplerate, bitdepth, channels, size ON sample_files BEGIN"
+                "  INSERT OR REPLACE INTO sample_ranges VALUES (" +
+                values("new") +
+                ");"
+                "END;"
+                "CREATE TRIGGER sample_ranges_ad AFTER DELETE ON sample_files BEGIN"
+                "  DELETE FROM sample_ranges WHERE id = old.ID;"
+                "END;");
+}
+
+// Extensions through an expression index on path_ext(name), exposed as the
+// ext column of samples. The file name is the indexed expression because
+// filepath is built by the view; path_dir(filepath) is dir_path, which the
+// directories path index already covers. Writing to sample_files now needs
+// path_ext() registered, as every connection opened here has.
+bool Database::migrate_path_functions()
+{
+  return exec(writer_.db,
+              "CREATE INDEX sample_files_ext ON sample_files(path_ext(name));"
+              "DROP VIEW samples;"
+              "CREATE VIEW samples AS SELECT"
+              "  s.ID AS ID, d.path || s.name AS filepath, s.size AS size, s.duration AS duration,"
+              "  s.samplerate AS samplerate, s.bitdepth AS bitdepth, s.channels AS channels,"
+              "  s.tags AS tags, s.dir_id AS dir_id, d.path AS dir_path, s.name AS name,"
+              "  d.sort_key AS dir_key, s.name_key AS name_key, path_ext(s.name) AS ext"
+              "  FROM sample_files s JOIN directories d ON d.id = s.dir_id;");
+}
+
+// Analysis results get a table of their own so list queries never read past
+// them. Each blob keeps its rowid when replaced, which sqlite3_blob_open()
+// needs to read slices of it.
+bool Database::migrate_analysis()
+{
+  return exec(writer_.db,
+              "CREATE TABLE sample_analysis ("
+              "  id INTEGER PRIMARY KEY,"
+              "  sample_id INTEGER NOT NULL,"
+              "  kind INTEGER NOT NULL,"
+              "  version INTEGER NOT NULL," // of the analysis that produced the data
+              "  data BLOB NOT NULL,"      // see encode_analysis()
+              "  UNIQUE (sample_id, kind));"
+              "CREATE TRIGGER sample_analysis_ad AFTER DELETE ON sample_files BEGIN"
+              "  DELETE FROM sample_analysis WHERE sample_id = old.ID;"
+              "END;");
+}
+
+// Attaches the file read-only as lib<N>. Nothing can migrate it that way, so
+// it has to be at the current schema version already.
+bool Database::attach_library(sqlite3 *db, const std::string &path, size_t library)
+{
+  // Characters URIs give a meaning to are escaped.
+  std::string uri = "file:";
+  for (char c : path)
+  {
+    if (c == '%' || c == '?' || c == '#')
+    {
+      char buf[4];
+      snprintf(buf, sizeof(buf), "%%%02X", static_cast<unsigned char>(c));
+      uri += buf;
+    }
+    else
+      uri += c;
+  }
+  uri += "?mode=ro";
+  const auto schema = schema_name(library);
+  sqlite3_stmt *stmt = nullptr;
+  int rc = sqlite3_prepare_v2(db, "ATTACH ? AS ?;", -1, &stmt, nullptr);
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_bind_text(stmt, 1, uri.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, schema.c_str(), -1, SQLITE_TRANSIENT);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK)
+  {
+    LOG("Can't attach library", path, ":", sqlite3_errmsg(db));
+    return false;
+  }
+  if (const int version = user_version(db, schema); version != schema_version)
+  {
+    LOG("Can't attach library", path, "at schema version", version,
+        "- open it as the main library once to bring it up to", schema_version);
+    exec(db, "DETACH " + schema + ";");
+    return false;
+  }
+  return true;
+}
+
+size_t Database::library_count(const SqlFilter &filter) const
+{
+  return filter.raw ? 1 : 1 + libraries_.size();
+}
+
+// Smart folders store their members along with the change-log position they
+// are current at, which update_smart_folders() moves forward.
+bool Database::migrate_smart_folders()
+{
+  return exec(writer_.db,
+              "CREATE TABLE smart_folders ("
+              "  id INTEGER PRIMARY KEY,"
+              "  name TEXT NOT NULL UNIQUE,"
+              "  filter TEXT NOT NULL,"
+              "  seq INTEGER NOT NULL);" // -1 until first filled
+              "CREATE TABLE smart_folder_members ("
+              "  folder_id INTEGER NOT NULL,"
+              "  sample_id INTEGER NOT NULL,"
+              "  PRIMARY KEY (folder_id, sample_id)) WITHOUT ROWID;"
+              "CREATE INDEX smart_folder_members_sample ON smart_folder_members(sample_id);"
+              "CREATE TRIGGER smart_folder_members_ad AFTER DELETE ON sample_files BEGIN"
+              "  DELETE FROM smart_folder_members WHERE sample_id = old.ID;"
+              "END;"
+              "CREATE TRIGGER smart_folders_ad AFTER DELETE ON smart_folders BEGIN"
+              "  DELETE FROM smart_folder_members WHERE folder_id = old.id;"
+              "END;");
+}
+
+// A random ID the sample store file is saved with, to tell whether it was
+// saved from this library; see load_sample_store().
+bool Database::migrate_library_id()
+{
+  return exec(writer_.db,
+              "CREATE TABLE library_id (id INTEGER NOT NULL);"
+              "INSERT INTO library_id (id) VALUES (random());");
+}
+
+// Counts the writes sample_changes doesn't log, for backup_stamp(). Smart
+// folder members only change along with their folder's row, so the folders
+// stand in for them; library_id is only written by migrations and in backups.
+bool Database::migrate_write_count()
+{
+  std::string sql = "CREATE TABLE write_count (n INTEGER NOT NULL);"
+                    "INSERT INTO write_count (n) VALUES (0);";
+  for (const std::string table : {"sample_analysis", "smart_folders"})
+    for (const std::string op : {"INSERT", "UPDATE", "DELETE"})
+      sql += "CREATE TRIGGER " + table + "_write_count_" + op + " AFTER " + op + " ON " + table +
+             " BEGIN UPDATE write_count SET n = n + 1; END;";
+  return exec(writer_.db, sql);
+}
+
+// ID of a directory, given its path with the trailing separator, adding it
+// and any missing parents. Only called with the write lock held.
+long long Database::directory_id(const std::string &path)
+{
+  if (auto it = dir_ids_.find(path); it != dir_ids_.end())
+    return it->second;
+
+  long long id = 0;
+  if (auto stmt = writer_.stmts.get("SELECT id FROM directories WHERE path = ?;"))
+  {
+    sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      id = sqlite3_column_int64(stmt, 0);
+  }
+  if (id == 0)
+  {
+    const auto [parent, name] = split_dir(path);
+    long long parent_id = 0;
+    if (!parent.empty())
+    {
+      parent_id = directory_id(parent);
+      if (parent_id == 0)
+        return 0;
+    }
+    auto stmt = writer_.stmts.get(
+      "INSERT INTO directories (parent_id, name, path, sort_key) VALUES (?, ?, ?, ?);");
+    if (!stmt)
+      return 0;
+    const auto key = dir_sort_key(path);
+    if (parent_id)
+      sqlite3_bind_int64(stmt, 1, parent_id);
+    sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, path.c_str(), -1, SQLITE_STATIC);
+    bind_blob(stmt, 4, key);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+      LOG("SQL error inserting directory:", sqlite3_errmsg(writer_.db));
+      return 0;
+    }
+    id = sqlite3_last_insert_rowid(writer_.db);
+  }
+  dir_ids_.emplace(path, id);
+  return id;
 }
 
 Database::~Database()
 {
-  sqlite3_close(db_);
+  LOG("Statement cache:", stmt_cache_hits(), "hits,", stmt_cache_misses(), "misses");
 }
 
-void Database::load_samples(std::vector<Sample> &samples_data, std::string where)
+bool Database::checkpoint(Checkpoint mode)
+{
+  const int modes[] = {SQLITE_CHECKPOINT_PASSIVE,
+                       SQLITE_CHECKPOINT_FULL,
+                       SQLITE_CHECKPOINT_RESTART,
+                       SQLITE_CHECKPOINT_TRUNCATE};
+  int wal_pages = 0;
+  int checkpointed = 0;
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  int rc = sqlite3_wal_checkpoint_v2(
+    writer_.db, "main", modes[static_cast<int>(mode)], &wal_pages, &checkpointed);
+  if (rc != SQLITE_OK)
+  {
+    LOG("WAL checkpoint failed:", sqlite3_errmsg(writer_.db));
+    return false;
+  }
+  LOG("WAL checkpoint:", checkpointed, "of", wal_pages, "pages");
+  return true;
+}
+
+// Change-log position, count of the other writes and schema version, which
+// tell whether two copies of the library hold the same data.
+static std::optional<std::tuple<long long, long long, int>> backup_stamp(sqlite3 *db)
+{
+  sqlite3_stmt *stmt = nullptr;
+  std::optional<std::tuple<long long, long long, int>> ret;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT (SELECT ifnull(max(seq), 0) FROM sample_changes),"
+                         " (SELECT n FROM write_count),"
+                         " (SELECT user_version FROM pragma_user_version);",
+                         -1,
+                         &stmt,
+                         nullptr) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    ret.emplace(sqlite3_column_int64(stmt, 0),
+                sqlite3_column_int64(stmt, 1),
+                sqlite3_column_int(stmt, 2));
+  sqlite3_finalize(stmt);
+  return ret;
+}
+
+bool Database::backup(const std::string &target, QueryToken *token, const BackupProgress &progress)
+{
+  std::unique_ptr<Connection> source;
+  try
+  {
+    source = std::make_unique<Connection>(
+      open_database(path_, SQLITE_OPEN_READONLY, options_.busy_timeout_ms));
+  }
+  catch (const std::runtime_error &)
+  {
+    return false;
+  }
+  // The read transaction pins one snapshot for the whole copy. Writes carry
+  // on into the WAL meanwhile, so the backup neither blocks them nor has to
+  // restart because of them.
+  const auto stamp = exec(source->db, "BEGIN;") ? backup_stamp(source->db) : std::nullopt;
+  if (!stamp)
+    return false;
+
+  std::error_code ec;
+  if (std::filesystem::exists(target, ec))
+  {
+    sqlite3 *previous = nullptr;
+    const bool unchanged =
+      sqlite3_open_v2(target.c_str(), &previous, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK &&
+      backup_stamp(previous) == stamp;
+    sqlite3_close(previous);
+    if (unchanged)
+    {
+      LOG("Backup is up to date:", target);
+      return true;
+    }
+  }
+
+  // Written next to the target and renamed over it once verified, so a
+  // failed or cancelled run leaves the previous backup alone.
+  const std::string part = target + ".part";
+  std::filesystem::remove(part, ec);
+  bool ok = false;
+  {
+    // Checking the copy needs the functions its indexes use.
+    std::unique_ptr<Connection> dest;
+    try
+    {
+      dest = std::make_unique<Connection>(open_database(
+        part, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, options_.busy_timeout_ms));
+    }
+    catch (const std::runtime_error &)
+    {
+      return false;
+    }
+    sqlite3 *db = dest->db;
+    sqlite3_backup *backup = sqlite3_backup_init(db, "main", source->db, "main");
+    if (!backup)
+    {
+      LOG("Can't start backup:", sqlite3_errmsg(db));
+      return false;
+    }
+    int rc;
+    do
+    {
+      rc = sqlite3_backup_step(backup, options_.backup_step_pages);
+      const int total = sqlite3_backup_pagecount(backup);
+      if (progress)
+        progress(total - sqlite3_backup_remaining(backup), total);
+      if (rc == SQLITE_DONE || (token && token->stopped()))
+        break;
+      sqlite3_sleep(options_.backup_step_sleep_ms);
+    } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+    sqlite3_backup_finish(backup);
+
+    if (rc != SQLITE_DONE)
+    {
+      if (!token || !token->stopped())
+        LOG("Backup failed:", sqlite3_errstr(rc));
+    }
+    // The copy takes over WAL mode from the header; a rollback journal makes
+    // it a single self-contained file. It is a library of its own from here
+    // on, so it gets its own ID.
+    else if (exec(db, "PRAGMA journal_mode=DELETE; UPDATE library_id SET id = random();"))
+    {
+      auto check = dest->stmts.get("PRAGMA integrity_check;");
+      ok = check && sqlite3_step(check) == SQLITE_ROW && column_text(check, 0) == "ok" &&
+           backup_stamp(db) == stamp;
+      if (!ok)
+        LOG("Backup failed verification:", part);
+    }
+  }
+  exec(source->db, "COMMIT;");
+  if (ok)
+  {
+    std::filesystem::rename(part, target, ec);
+    ok = !ec;
+    if (!ok)
+      LOG("Can't move backup into place:", ec.message());
+  }
+  if (!ok)
+    std::filesystem::remove(part, ec);
+  else
+    LOG("Backed up to", target);
+  return ok;
+}
+
+void Database::writer_idle()
+{
+  ++writes_;
+  if (writer_.on_idle)
+    writer_.on_idle(writer_);
+}
+
+// Makes the statements run while it lives answer to a token: cancel()
+// interrupts them and the progress handler stops them once over budget.
+class TokenScope
+{
+public:
+  TokenScope(QueryToken *token, sqlite3 *db) : token_(token), db_(db)
+  {
+    if (!token_)
+      return;
+    token_->attach(db_);
+    sqlite3_progress_handler(
+      db_, 1000, [](void *t) { return static_cast<QueryToken *>(t)->stopped() ? 1 : 0; }, token_);
+  }
+  ~TokenScope()
+  {
+    if (!token_)
+      return;
+    sqlite3_progress_handler(db_, 0, nullptr, nullptr);
+    token_->detach();
+  }
+
+private:
+  QueryToken *token_;
+  sqlite3 *db_;
+};
+
+static void log_read_error(const char *what, int rc, sqlite3 *db, QueryToken *token)
+{
+  if (rc == SQLITE_INTERRUPT && token)
+    return;
+  LOG(what, sqlite3_errmsg(db));
+}
+
+static std::string where_clause(const SqlFilter &filter, size_t library = 0)
+{
+  return filter.where.empty() ? std::string{}
+                              : " WHERE (" + filter.where_in(schema_name(library)) + ")";
+}
+
+// Counting everything skips the directory join behind the samples view.
+static std::string count_from(const SqlFilter &filter, size_t library = 0)
+{
+  const auto schema = schema_name(library);
+  return filter.where.empty() ? " FROM " + schema + ".sample_files"
+                              : " FROM " + schema + ".samples" + where_clause(filter, library);
+}
+
+// Matches summed over the libraries; bind the filter once per library.
+static std::string count_sum(const SqlFilter &filter, size_t libraries)
+{
+  std::string ret;
+  for (size_t k = 0; k < libraries; ++k)
+    ret += (k ? " + " : "") + std::string{"(SELECT COUNT(*)"} + count_from(filter, k) + ")";
+  return ret;
+}
+
+// Display order, see migrate_sort_keys().
+static const char *sample_order = "dir_key, name_key, ID";
+
+// The rows of the libraries in display order, with `keyset` added to the
+// conditions. Each library is one arm of a UNION ALL that walks its own
+// indexes in that order, and SQLite merges the arms as they go; the constant
+// `lib` and the library's own ID break ties, which sorts rows like their
+// offset IDs would. The filter's parameters and then the keyset's are bound
+// once per library.
+static std::string select_samples(const SqlFilter &filter,
+                                  size_t libraries,
+                                  const std::string &keyset = {})
+{
+  auto where = [&](size_t k) {
+    const auto clause = where_clause(filter, k);
+    return keyset.empty() ? clause : clause + (clause.empty() ? " WHERE " : " AND ") + keyset;
+  };
+  if (libraries == 1)
+    return std::string{"SELECT "} + sample_columns + " FROM samples" + where(0) + " ORDER BY " +
+           sample_order;
+  std::string ret;
+  for (size_t k = 0; k < libraries; ++k)
+  {
+    const auto offset = static_cast<long long>(k) << Database::library_shift;
+    ret += std::string{k ? " UNION ALL " : ""} + "SELECT " +
+           (k ? "ID + " + std::to_string(offset) + " AS ID" : std::string{"ID"}) +
+           ", filepath, size, duration, samplerate, bitdepth, channels, tags, dir_key, name_key, " +
+           std::to_string(k) + " AS lib, ID AS local_id FROM " + schema_name(k) + ".samples" +
+           where(k);
+  }
+  return ret + " ORDER BY dir_key, name_key, lib, local_id";
+}
+
+// Splits a filepath into the directory path, up to the last separator, and
+// the file name.
+static std::pair<std::string, std::string> split_path(const std::string &filepath)
+{
+  const auto sep = filepath.rfind('/');
+  return sep == std::string::npos
+           ? std::pair{std::string{}, filepath}
+           : std::pair{filepath.substr(0, sep + 1), filepath.substr(sep + 1)};
+}
+
+void Database::load_samples(std::vector<Sample> &samples_data,
+                            const SqlFilter &filter,
+                            QueryToken *token)
 {
   samples_data.clear();
+  const size_t libraries = library_count(filter);
+  const std::string select_sql = select_samples(filter, libraries) + ";";
+  auto reader = readers_.acquire();
+  TokenScope scope(token, reader->db);
+  auto stmt = reader->stmts.get(select_sql);
+  if (stmt)
+  {
+    int idx = 1;
+    for (size_t k = 0; k < libraries; ++k)
+      idx = bind_params(stmt, filter.params, idx);
+    int rc_select;
+    while ((rc_select = sqlite3_step(stmt)) == SQLITE_ROW)
+      samples_data.push_back(read_sample(stmt));
+    if (rc_select != SQLITE_DONE)
+    {
+      log_read_error("SQL error selecting data:", rc_select, reader->db, token);
+    }
+  }
+}
+
+size_t Database::count_samples(const SqlFilter &filter, QueryToken *token, long long *change_seq)
+{
+  // One statement, so the count and the log position come from one snapshot.
+  const size_t libraries = library_count(filter);
+  const std::string count_sql = "SELECT " + count_sum(filter, libraries) +
+                                ", (SELECT ifnull(max(seq), 0) FROM sample_changes);";
+  auto reader = readers_.acquire();
+  TokenScope scope(token, reader->db);
+  auto stmt = reader->stmts.get(count_sql);
+  if (!stmt)
+    return 0;
+  int idx = 1;
+  for (size_t k = 0; k < libraries; ++k)
+    idx = bind_params(stmt, filter.params, idx);
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW)
+  {
+    log_read_error("SQL error counting samples:", rc, reader->db, token);
+    return 0;
+  }
+  if (change_seq)
+    *change_seq = sqlite3_column_int64(stmt, 1);
+  return sqlite3_column_int64(stmt, 0);
+}
+
+void Database::load_sample_page(std::vector<Sample> &page,
+                                const SqlFilter &filter,
+                                const Sample *after,
+                                size_t offset,
+                                size_t limit,
+                                QueryToken *token)
+{
+  page.clear();
+  // The range on dir_key steers SQLite into walking directories in order from
+  // the key's, even for the first page, rather than sorting every row.
+  std::string keyset = "dir_key >= ?";
+  if (after)
+    keyset += " AND (dir_key, name_key, ID) > (?, ?, ?)";
+  const size_t libraries = library_count(filter);
   const std::string select_sql =
-    "SELECT filepath, size, duration, samplerate, bitdepth, channels, tags FROM samples" +
-    (!where.empty() ? (" WHERE " + where) : std::string{}) + " ORDER BY filepath;";
-  sqlite3_stmt *stmt;
-  int rc_select = sqlite3_prepare_v2(db_, select_sql.c_str(), -1, &stmt, 0);
-  if (rc_select != SQLITE_OK)
+    select_samples(filter, libraries, keyset) + " LIMIT ? OFFSET ?;";
+  auto reader = readers_.acquire();
+  TokenScope scope(token, reader->db);
+  auto stmt = reader->stmts.get(select_sql);
+  if (!stmt)
+    return;
+  std::string dir_key;
+  std::string name_key;
+  if (after)
+  {
+    const auto [dir, name] = split_path(after->filepath);
+    dir_key = dir_sort_key(dir);
+    name_key = natural_key(name);
+  }
+  int idx = 1;
+  for (size_t k = 0; k < libraries; ++k)
+  {
+    idx = bind_params(stmt, filter.params, idx);
+    bind_blob(stmt, idx++, dir_key);
+    if (after)
+    {
+      // Rows with the same keys as `after` follow it in later libraries only.
+      const auto library = static_cast<size_t>(library_of(after->id));
+      const long long id = k == library ? after->id & ((1LL << library_shift) - 1)
+                           : k > library ? std::numeric_limits<long long>::min()
+                                         : std::numeric_limits<long long>::max();
+      bind_blob(stmt, idx++, dir_key);
+      bind_blob(stmt, idx++, name_key);
+      sqlite3_bind_int64(stmt, idx++, id);
+    }
+  }
+  sqlite3_bind_int64(stmt, idx++, limit);
+  sqlite3_bind_int64(stmt, idx++, offset);
+  page.reserve(limit);
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    page.push_back(read_sample(stmt));
+  if (rc != SQLITE_DONE)
+    log_read_error("SQL error selecting page:", rc, reader->db, token);
+}
+
+std::vector<Facet> Database::facets(const SqlFilter &filter, QueryToken *token)
+{
+  using F = FacetBuilder;
+  F builder;
+  auto reader = readers_.acquire();
+  TokenScope scope(token, reader->db);
+  auto add = [&](F::Field field, sqlite3_stmt *stmt, int col, size_t count) {
+    if (sqlite3_column_type(stmt, col) == SQLITE_TEXT)
+      builder.add(field, column_text(stmt, col), count);
+    else
+      builder.add(field, sqlite3_column_int64(stmt, col), count);
+  };
+
+  // Counts add up across libraries in the builder.
+  const size_t libraries = library_count(filter);
+  if (filter.where.empty())
+  {
+    for (size_t k = 0; k < libraries; ++k)
+    {
+      auto stmt = reader->stmts.get("SELECT facet, value, count FROM " + schema_name(k) +
+                                    ".facet_counts WHERE count > 0;");
+      if (!stmt)
+        return {};
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      {
+        const auto key = column_text(stmt, 0);
+        for (int f = 0; f < F::FieldCount; ++f)
+          if (key == F::key(static_cast<F::Field>(f)))
+            add(static_cast<F::Field>(f), stmt, 1, sqlite3_column_int64(stmt, 2));
+      }
+      if (rc != SQLITE_DONE)
+      {
+        log_read_error("SQL error reading facet counts:", rc, reader->db, token);
+        return {};
+      }
+    }
+    return builder.build();
+  }
+
+  for (size_t k = 0; k < libraries; ++k)
+  {
+    const auto schema = schema_name(k);
+    // Every sample facet in one scan of the matches, columns in Field order;
+    // the groups are few enough to split up per facet here.
+    const std::string group_sql = "SELECT samplerate, channels, bitdepth, " +
+                                  F::duration_sql("duration") + ", dir_path" + ", COUNT(*) FROM " +
+                                  schema + ".samples" + where_clause(filter, k) +
+                                  " GROUP BY 1, 2, 3, 4, 5;";
+    if (auto stmt = reader->stmts.get(group_sql))
+    {
+      bind_params(stmt, filter.params);
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      {
+        const size_t count = sqlite3_column_int64(stmt, 5);
+        for (auto field : {F::SampleRate, F::Channels, F::BitDepth, F::Duration, F::Folder})
+          add(field, stmt, field, count);
+      }
+      if (rc != SQLITE_DONE)
+      {
+        log_read_error("SQL error counting facets:", rc, reader->db, token);
+        return {};
+      }
+    }
+    const std::string tag_sql = "SELECT lower(tag), COUNT(*) FROM " + schema +
+                                ".sample_tags WHERE sample_id IN (SELECT ID FROM " + schema +
+                                ".samples" + where_clause(filter, k) + ") GROUP BY 1;";
+    if (auto stmt = reader->stmts.get(tag_sql))
+    {
+      bind_params(stmt, filter.params);
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        add(F::Tag, stmt, 0, sqlite3_column_int64(stmt, 1));
+      if (rc != SQLITE_DONE)
+      {
+        log_read_error("SQL error counting tags:", rc, reader->db, token);
+        return {};
+      }
+    }
+  }
+  return builder.build();
+}
+
+SampleChanges Database::sample_changes(long long since,
+                                      const SqlFilter &filter,
+                                      QueryToken *token)
+{
+  SampleChanges ret;
+  auto reader = readers_.acquire();
+  TokenScope scope(token, reader->db);
+  // The log, the rows and the count have to agree, so read them in one snapshot.
+  if (!run(*reader, "BEGIN;"))
+  {
+    ret.complete = false;
+    return ret;
+  }
+  if (auto stmt = reader->stmts.get("SELECT min(seq), ifnull(max(seq), 0) FROM sample_changes;"))
   {
-    LOG("SQL error preparing select:", sqlite3_errmsg(db_));
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      ret.seq = sqlite3_column_int64(stmt, 1);
+      const bool pruned = sqlite3_column_type(stmt, 0) != SQLITE_NULL &&
+                          sqlite3_column_int64(stmt, 0) > since + 1;
+      ret.complete = !pruned && ret.seq >= since;
+    }
+  }
+
+  // The log and the rows are read apart: on the right of a LEFT JOIN SQLite
+  // would materialize the whole view before looking the changed rows up.
+  auto stmt = ret.complete ? reader->stmts.get("SELECT sample_id, old_filepath FROM sample_changes "
+                                               "WHERE seq > ? AND seq <= ? ORDER BY seq;")
+                           : StmtCache::Stmt{};
+  std::unordered_map<long long, size_t> positions; // sample ID to its entry in changes
+  if (stmt)
+  {
+    sqlite3_bind_int64(stmt, 1, since);
+    sqlite3_bind_int64(stmt, 2, ret.seq);
+    // A sample changed several times is reported once, with the key from its
+    // first change, the one a list that is behind may still show it under.
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      const long long id = sqlite3_column_int64(stmt, 0);
+      if (positions.emplace(id, ret.changes.size()).second)
+      {
+        SampleChange change{id, std::nullopt, std::nullopt};
+        if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+          change.old_filepath = column_text(stmt, 1);
+        ret.changes.push_back(std::move(change));
+      }
+    }
+    if (rc != SQLITE_DONE)
+    {
+      log_read_error("SQL error reading changes:", rc, reader->db, token);
+      ret.complete = false;
+    }
+  }
+  stmt = StmtCache::Stmt{};
+
+  const std::string rows_sql =
+    std::string{"SELECT "} + sample_columns +
+    " FROM samples WHERE ID IN (SELECT sample_id FROM sample_changes WHERE seq > ? AND seq <= ?)" +
+    (filter.where.empty() ? std::string{} : " AND (" + filter.where + ")") + ";";
+  stmt = ret.complete && !ret.changes.empty() ? reader->stmts.get(rows_sql) : StmtCache::Stmt{};
+  if (stmt)
+  {
+    sqlite3_bind_int64(stmt, 1, since);
+    sqlite3_bind_int64(stmt, 2, ret.seq);
+    bind_params(stmt, filter.params, 3);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      auto row = read_sample(stmt);
+      ret.changes[positions.at(row.id)].row = std::move(row);
+    }
+    if (rc != SQLITE_DONE)
+    {
+      log_read_error("SQL error reading changed samples:", rc, reader->db, token);
+      ret.complete = false;
+    }
+  }
+  stmt = StmtCache::Stmt{};
+
+  if (ret.complete)
+  {
+    const size_t libraries = library_count(filter);
+    const std::string count_sql = "SELECT " + count_sum(filter, libraries) + ";";
+    auto count = reader->stmts.get(count_sql);
+    int idx = 1;
+    for (size_t k = 0; count && k < libraries; ++k)
+      idx = bind_params(count, filter.params, idx);
+    ret.complete = count && sqlite3_step(count) == SQLITE_ROW;
+    if (ret.complete)
+      ret.size = sqlite3_column_int64(count, 0);
+  }
+  // An interrupt may already have ended the transaction.
+  if (!sqlite3_get_autocommit(reader->db))
+    run(*reader, "COMMIT;");
+  return ret;
+}
+
+bool Database::refresh_sample_store(QueryToken *token)
+{
+  // Taken before reading, so a write that races the refresh brings on another.
+  const auto generation = this->generation();
+  if (const auto current = sample_store_.get())
+  {
+    if (generation == sample_store_generation_)
+      return true;
+    auto changes = sample_changes(current->seq(), {}, token);
+    if (token && token->stopped())
+      return false;
+    if (changes.complete)
+    {
+      if (!changes.changes.empty())
+      {
+        // Merges the rows with the changes, both in ID order, into a new arena.
+        std::sort(changes.changes.begin(),
+                  changes.changes.end(),
+                  [](const SampleChange &a, const SampleChange &b) { return a.id < b.id; });
+        const auto &ids = current->columns().id;
+        SampleSnapshot::Builder rows;
+        rows.reserve(ids.size() + changes.changes.size(),
+                     current->columns().filepath.text_size(),
+                     current->columns().tags.arena.size());
+        FrontCodedStrings::Reader paths(current->columns().filepath);
+        size_t row = 0;
+        for (const auto &change : changes.changes)
+        {
+          for (; row < ids.size() && ids[row] < change.id; ++row)
+            rows.add(current->row(row, paths));
+          if (row < ids.size() && ids[row] == change.id)
+            ++row;
+          if (change.row)
+            rows.add(*change.row);
+        }
+        for (; row < ids.size(); ++row)
+          rows.add(current->row(row, paths));
+        sample_store_.set(std::make_shared<const SampleSnapshot>(std::move(rows), changes.seq));
+      }
+      sample_store_generation_ = generation;
+      return true;
+    }
+  }
+
+  SampleSnapshot::Builder rows;
+  // The rows read last time are a good guess at the size.
+  if (const auto current = sample_store_.get())
+    rows.reserve(current->size(),
+                 current->columns().filepath.text_size(),
+                 current->columns().tags.arena.size());
+  long long seq = 0;
+  bool ok = false;
+  {
+    auto reader = readers_.acquire();
+    TokenScope scope(token, reader->db);
+    // The rows and the log position they are as of come from one snapshot.
+    if (!run(*reader, "BEGIN;"))
+      return false;
+    if (auto stmt = reader->stmts.get("SELECT ifnull(max(seq), 0) FROM sample_changes;"))
+    {
+      ok = sqlite3_step(stmt) == SQLITE_ROW;
+      seq = ok ? sqlite3_column_int64(stmt, 0) : 0;
+    }
+    const std::string select_sql =
+      std::string{"SELECT "} + sample_columns + " FROM samples ORDER BY ID;";
+    if (auto stmt = ok ? reader->stmts.get(select_sql) : StmtCache::Stmt{})
+    {
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      {
+        SampleRef row;
+        read_record(stmt, row);
+        rows.add(row);
+      }
+      ok = rc == SQLITE_DONE;
+      if (!ok)
+        log_read_error("SQL error loading the sample store:", rc, reader->db, token);
+    }
+    if (!sqlite3_get_autocommit(reader->db))
+      run(*reader, "COMMIT;");
+  }
+  if (!ok)
+    return false;
+  sample_store_.set(std::make_shared<const SampleSnapshot>(std::move(rows), seq));
+  sample_store_generation_ = generation;
+  return true;
+}
+
+// Empty for a database that has no file of its own.
+static std::string sample_store_path(const std::string &db_path)
+{
+  return db_path.empty() || db_path == ":memory:" ? std::string{} : db_path + ".store";
+}
+
+long long Database::library_id()
+{
+  auto reader = readers_.acquire();
+  auto stmt = reader->stmts.get("SELECT id FROM library_id;");
+  return stmt && sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+}
+
+bool Database::load_sample_store()
+{
+  const auto path = sample_store_path(path_);
+  // Only a file saved from this library will do; backups get IDs of their
+  // own, so one restored over the library doesn't take a file saved after it.
+  auto snapshot = path.empty() ? nullptr : SampleSnapshot::map(path, library_id());
+  if (!snapshot)
+    return false;
+  // The log has to go on from where the file stops: a position past its end
+  // or one it was pruned past means the file is from another state of the library.
+  bool ok = false;
+  {
+    auto reader = readers_.acquire();
+    if (auto stmt = reader->stmts.get("SELECT min(seq), ifnull(max(seq), 0) FROM sample_changes;"))
+      ok = sqlite3_step(stmt) == SQLITE_ROW && snapshot->seq() <= sqlite3_column_int64(stmt, 1) &&
+           (sqlite3_column_type(stmt, 0) == SQLITE_NULL ||
+            sqlite3_column_int64(stmt, 0) <= snapshot->seq() + 1);
+  }
+  if (!ok)
+  {
+    LOG("Sample store file is out of date:", path);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sample_store_file_mutex_);
+    sample_store_saved_seq_ = snapshot->seq();
+  }
+  sample_store_.set(std::move(snapshot));
+  // Not known to be current, so the next refresh reads the log.
+  sample_store_generation_ = std::numeric_limits<unsigned long long>::max();
+  return true;
+}
+
+bool Database::save_sample_store()
+{
+  const auto path = sample_store_path(path_);
+  const auto snapshot = sample_store_.get();
+  std::lock_guard<std::mutex> lock(sample_store_file_mutex_);
+  if (path.empty() || !snapshot || snapshot->seq() == sample_store_saved_seq_)
+    return true;
+  if (!snapshot->save(path, library_id()))
+  {
+    LOG("Failed to write the sample store file:", path);
+    return false;
+  }
+  sample_store_saved_seq_ = snapshot->seq();
+  return true;
+}
+
+unsigned long long Database::generation()
+{
+  // Skip the check while a write is in progress, it bumps writes_ anyway.
+  std::unique_lock<std::mutex> lock(write_mutex_, std::try_to_lock);
+  if (lock.owns_lock())
+  {
+    auto stmt = writer_.stmts.get("PRAGMA data_version;");
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      const long long version = sqlite3_column_int64(stmt, 0);
+      if (version != data_version_)
+        ++external_writes_;
+      data_version_ = version;
+    }
+    for (size_t i = 0; i < libraries_.size(); ++i)
+    {
+      const long long version = data_version(writer_, schema_name(i + 1));
+      if (version != attached_versions_[i])
+      {
+        ++attached_writes_;
+        ++external_writes_;
+      }
+      attached_versions_[i] = version;
+    }
+  }
+  return writes_ + external_writes_;
+}
+
+bool Database::maintain(Maintenance task, QueryToken *token)
+{
+  // Tables whose statistics matter to the plans, checked one per slice.
+  static const char *analyzed_tables[] = {
+    "sample_files", "directories", "sample_tags", "facet_counts", "sample_changes"};
+  // A file of its own, written without holding up the writer. The store is
+  // caught up here, while idle, rather than after every write.
+  if (task == Maintenance::SaveSampleStore)
+  {
+    if (refresh_sample_store(token))
+      save_sample_store();
+    return false;
+  }
+  const std::string step = std::to_string(options_.maintenance_step);
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  TokenScope scope(token, writer_.db);
+  auto single = [&](const std::string &sql) -> long long {
+    auto stmt = writer_.stmts.get(sql);
+    return stmt && sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+  };
+  bool more = false;
+  switch (task)
+  {
+  case Maintenance::Analyze: {
+    const std::string table = analyzed_tables[analyze_next_];
+    // Stale once the row count is a tenth off what the statistics recorded.
+    long long recorded = -1;
+    if (single("SELECT count(*) FROM sqlite_master WHERE name = 'sqlite_stat1';") > 0)
+      if (auto stmt =
+            writer_.stmts.get("SELECT max(CAST(stat AS INTEGER)) FROM sqlite_stat1 WHERE tbl = ?;"))
+      {
+        sqlite3_bind_text(stmt, 1, table.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+          recorded = sqlite3_column_int64(stmt, 0);
+      }
+    const long long rows = single("SELECT count(*) FROM " + table + ";");
+    bool ok = rows >= 0;
+    if (ok && (recorded < 0 || std::llabs(rows - recorded) * 10 > recorded))
+      ok = exec(writer_.db, "PRAGMA analysis_limit=" + step + "; ANALYZE " + table + ";");
+    // A table whose slice was cut short or failed is checked again next time.
+    if (ok && !(token && token->stopped()))
+    {
+      analyze_next_ = (analyze_next_ + 1) % std::size(analyzed_tables);
+      more = analyze_next_ != 0;
+    }
+    break;
+  }
+  case Maintenance::Optimize:
+    exec(writer_.db, "PRAGMA main.optimize;");
+    break;
+  case Maintenance::FtsMerge: {
+    // The merge is through once a call changes fewer than two rows.
+    const int before = sqlite3_total_changes(writer_.db);
+    exec(writer_.db, "INSERT INTO samples_fts(samples_fts, rank) VALUES ('merge', " + step + ");");
+    more = sqlite3_total_changes(writer_.db) - before >= 2;
+    break;
   }
+  case Maintenance::IncrementalVacuum:
+    if (single("PRAGMA auto_vacuum;") == 2 && single("PRAGMA freelist_count;") > 0)
+    {
+      exec(writer_.db, "PRAGMA incremental_vacuum(" + step + ");");
+      more = single("PRAGMA freelist_count;") > 0;
+    }
+    break;
+  case Maintenance::Checkpoint:
+    sqlite3_wal_checkpoint_v2(writer_.db, "main", SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+    break;
+  case Maintenance::SaveSampleStore:
+  case Maintenance::Count:
+    break;
+  }
+  // Not a data change, so writes_ stays; the profiler still gets to flush.
+  if (writer_.on_idle)
+    writer_.on_idle(writer_);
+  return more && !(token && token->stopped());
+}
+
+// Export files are this header followed by batches of samples, the last one
+// empty, each a msgpack value of its own so neither side holds the whole
+// library in memory.
+struct ExportHeader
+{
+  std::string format = "sfx-db samples";
+  int version = 1;
+  long long count = 0; // samples in the batches
+  SER_PROPS(format, version, count);
+};
+
+struct ExportBatch
+{
+  std::vector<Sample> samples;
+  SER_PROPS(samples);
+};
+
+static const size_t export_batch_size = 1000;
+
+bool Database::export_samples(const std::string &target,
+                              QueryToken *token,
+                              const TransferProgress &progress)
+{
+  const std::string part = target + ".part";
+  std::ofstream out(part, std::ios::binary | std::ios::trunc);
+  if (!out)
+  {
+    LOG("Can't write export:", part);
+    return false;
+  }
+  ExportHeader header;
+  ExportBatch batch;
+  bool ok = false;
+  {
+    auto reader = readers_.acquire();
+    TokenScope scope(token, reader->db);
+    // The count and the rows come from the same snapshot.
+    if (!run(*reader, "BEGIN;"))
+      return false;
+    if (auto stmt = reader->stmts.get("SELECT COUNT(*) FROM sample_files;");
+        stmt && sqlite3_step(stmt) == SQLITE_ROW)
+      header.count = sqlite3_column_int64(stmt, 0);
+    msgpackSer(out, header);
+    if (auto stmt = reader->stmts.get(std::string{"SELECT "} + sample_columns +
+                                      " FROM samples ORDER BY ID;"))
+    {
+      size_t done = 0;
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      {
+        batch.samples.push_back(read_sample(stmt));
+        if (batch.samples.size() < export_batch_size)
+          continue;
+        msgpackSer(out, batch);
+        done += batch.samples.size();
+        batch.samples.clear();
+        if (progress)
+          progress(done, header.count);
+      }
+      if (rc != SQLITE_DONE)
+        log_read_error("SQL error exporting samples:", rc, reader->db, token);
+      else
+      {
+        if (!batch.samples.empty())
+          msgpackSer(out, batch);
+        batch.samples.clear();
+        msgpackSer(out, batch);
+        ok = true;
+      }
+    }
+    run(*reader, "COMMIT;");
+  }
+  out.close();
+  if (ok && !out)
+  {
+    LOG("Error writing export:", part);
+    ok = false;
+  }
+  std::error_code ec;
+  if (ok)
+  {
+    std::filesystem::rename(part, target, ec);
+    ok = !ec;
+    if (!ok)
+      LOG("Can't move export into place:", ec.message());
+  }
+  if (!ok)
+    std::filesystem::remove(part, ec);
   else
+    LOG("Exported", header.count, "samples to", target);
+  return ok;
+}
+
+// Insert triggers whose work import_samples() does in bulk afterwards.
+static const char *import_deferred_triggers = "'samples_fts_ai', 'facet_counts_ai', "
+                                              "'facet_counts_tag_ai', 'sample_ranges_ai', "
+                                              "'sample_changes_ai'";
+
+bool Database::import_samples(const std::string &source,
+                              QueryToken *token,
+                              const TransferProgress &progress)
+{
+  std::ifstream in(source, std::ios::binary);
+  if (!in)
   {
-    while ((rc_select = sqlite3_step(stmt)) == SQLITE_ROW)
+    LOG("Can't open import:", source);
+    return false;
+  }
+  ExportHeader header;
+  try
+  {
+    msgpackDeser(in, header);
+  }
+  catch (const std::exception &e)
+  {
+    LOG("Can't read import:", source, e.what());
+    return false;
+  }
+  if (header.format != ExportHeader{}.format || header.version != ExportHeader{}.version)
+  {
+    LOG("Not a sample export this version can read:", source);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  TokenScope scope(token, writer_.db);
+  if (!run(writer_, "BEGIN IMMEDIATE;"))
+    return false;
+  long long last_id = 0; // imported rows get IDs above it
+  long long rows = 0;
+  if (auto stmt = writer_.stmts.get("SELECT ifnull(max(ID), 0), COUNT(*) FROM sample_files;");
+      stmt && sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    last_id = sqlite3_column_int64(stmt, 0);
+    rows = sqlite3_column_int64(stmt, 1);
+  }
+  // Dropped for the load and created again from their own SQL afterwards.
+  // Rebuilding an index sorts the whole table, which only beats updating it
+  // row by row when the import is about as big as the library already is.
+  std::vector<std::string> deferred;
+  std::string drop;
+  if (auto stmt = writer_.stmts.get(
+        std::string{"SELECT type, name, sql FROM sqlite_master"
+                    " WHERE type = 'trigger' AND name IN ("} +
+        import_deferred_triggers +
+        ") OR type = 'index' AND tbl_name = 'sample_files' AND sql IS NOT NULL AND ?;"))
+  {
+    sqlite3_bind_int(stmt, 1, header.count >= rows);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
     {
-      Sample s;
-      s.filepath = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-      s.size = sqlite3_column_int64(stmt, 1);
-      s.duration = sqlite3_column_double(stmt, 2);
-      s.sample_rate = sqlite3_column_int(stmt, 3);
-      s.bit_depth = sqlite3_column_int(stmt, 4);
-      s.channels = sqlite3_column_int(stmt, 5);
-      s.tags = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 6));
-      samples_data.push_back(s);
+      drop += "DROP " + column_text(stmt, 0) + " " + column_text(stmt, 1) + ";";
+      deferred.push_back(column_text(stmt, 2) + ";");
     }
-    if (rc_select != SQLITE_DONE)
+  }
+  bool ok = exec(writer_.db, drop);
+
+  size_t done = 0;
+  ExportBatch batch;
+  while (ok)
+  {
+    try
     {
-      LOG("SQL error selecting data:", sqlite3_errmsg(db_));
+      msgpackDeser(in, batch);
     }
-    sqlite3_finalize(stmt);
+    catch (const std::exception &e)
+    {
+      LOG("Can't read import:", source, e.what());
+      ok = false;
+      break;
+    }
+    if (batch.samples.empty())
+      break;
+    ok = insert_rows(batch.samples);
+    done += batch.samples.size();
+    if (progress)
+      progress(done, header.count);
+    if (token && token->stopped())
+      ok = false;
   }
+
+  using F = FacetBuilder;
+  if (ok)
+  {
+    std::string sql = "INSERT INTO samples_fts(rowid, filepath, tags)"
+                      "  SELECT ID, filepath, tags FROM samples WHERE ID > ?1;"
+                      "INSERT INTO sample_ranges SELECT ID, duration, duration,"
+                      "  samplerate, samplerate, bitdepth, bitdepth, channels, channels, size, size"
+                      "  FROM sample_files WHERE ID > ?1;";
+    const std::pair<F::Field, std::string> columns[] = {
+      {F::SampleRate, "samplerate"},
+      {F::Channels, "channels"},
+      {F::BitDepth, "bitdepth"},
+      {F::Duration, F::duration_sql("duration")},
+      {F::Folder, "dir_path"},
+    };
+    for (const auto &[field, expr] : columns)
+      sql += std::string{"INSERT INTO facet_counts (facet, value, count) SELECT '"} +
+             F::key(field) + "', " + expr +
+             ", COUNT(*) FROM samples WHERE ID > ?1 GROUP BY 2"
+             " ON CONFLICT (facet, value) DO UPDATE SET count = count + excluded.count;";
+    sql += std::string{"INSERT INTO facet_counts (facet, value, count) SELECT '"} +
+           F::key(F::Tag) +
+           "', lower(tag), COUNT(*) FROM sample_tags WHERE sample_id > ?1 GROUP BY 2"
+           " ON CONFLICT (facet, value) DO UPDATE SET count = count + excluded.count;";
+    // One statement at a time, as the bulk statements share the ID bound.
+    auto run_all = [&](const std::string &statements) {
+      const char *tail = statements.c_str();
+      while (ok && *tail)
+      {
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(writer_.db, tail, -1, &stmt, &tail) != SQLITE_OK)
+          ok = false;
+        else if (stmt)
+        {
+          sqlite3_bind_int64(stmt, 1, last_id);
+          ok = sqlite3_step(stmt) == SQLITE_DONE;
+        }
+        if (!ok)
+          LOG("SQL error finishing import:", sqlite3_errmsg(writer_.db));
+        sqlite3_finalize(stmt);
+      }
+    };
+    run_all(sql);
+    ok = ok && update_smart_folders(last_id);
+    // The log restarts past a gap, so every list sees it as pruned and
+    // reloads rather than replaying the import row by row. Smart folders
+    // have the new rows already.
+    run_all("INSERT INTO sample_changes (seq, sample_id)"
+            "  SELECT ifnull((SELECT seq FROM sqlite_sequence"
+            "    WHERE name = 'sample_changes'), 0) + 2,"
+            "    ifnull((SELECT max(ID) FROM sample_files), 0);"
+            "DELETE FROM sample_changes WHERE seq < (SELECT max(seq) FROM sample_changes);"
+            "UPDATE smart_folders SET seq = (SELECT max(seq) FROM sample_changes);");
+  }
+  for (const auto &sql : deferred)
+    ok = ok && exec(writer_.db, sql);
+
+  run(writer_, ok ? "COMMIT;" : "ROLLBACK;");
+  if (!ok)
+    dir_ids_.clear();
+  else
+    LOG("Imported", done, "samples from", source);
+  writer_idle();
+  return ok;
 }
 
 void Database::insert_sample(const Sample &sample)
 {
-  std::string insert_sql = "INSERT INTO samples (filepath, size, duration, samplerate, "
-                           "bitdepth, channels, tags) VALUES (?, ?, ?, ?, ?, ?, ?);";
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db_, insert_sql.c_str(), -1, &stmt, 0);
-  if (rc != SQLITE_OK)
+  insert_samples({sample});
+}
+
+void Database::insert_samples(const std::vector<Sample> &samples)
+{
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if (!run(writer_, "BEGIN IMMEDIATE;"))
+    return;
+  const bool ok = insert_rows(samples) && update_smart_folders();
+  if (ok)
+    LOG("Inserted", samples.size(), "samples.");
+  run(writer_, ok ? "COMMIT;" : "ROLLBACK;");
+  // Directories added by a rolled back insert are gone again.
+  if (!ok)
+    dir_ids_.clear();
+  writer_idle();
+}
+
+bool Database::insert_rows(const std::vector<Sample> &samples)
+{
+  static const auto sql = insert_sql<SampleFileRow>("sample_files");
+  std::vector<SampleFileRow> rows;
+  rows.reserve(samples.size());
+  for (const auto &sample : samples)
   {
-    LOG("SQL error preparing insert:", sqlite3_errmsg(db_));
+    const auto [dir, name] = split_path(sample.filepath);
+    const long long dir_id = directory_id(dir);
+    if (!dir_id)
+      return false;
+    rows.push_back({dir_id,
+                    name,
+                    sample.size,
+                    sample.duration,
+                    sample.sample_rate,
+                    sample.bit_depth,
+                    sample.channels,
+                    sample.tags,
+                    {natural_key(name)}});
   }
-  else
+  auto stmt = writer_.stmts.get(sql);
+  if (!stmt)
+    return false;
+  if (!insert_records(stmt, rows, [&](const SampleFileRow &row) {
+        insert_tags(sqlite3_last_insert_rowid(writer_.db), row.tags);
+        return true;
+      }))
+  {
+    LOG("SQL error inserting data:", sqlite3_errmsg(writer_.db));
+    return false;
+  }
+  return true;
+}
+
+void Database::insert_tags(long long id, const std::string &tags)
+{
+  auto stmt = writer_.stmts.get("INSERT OR IGNORE INTO sample_tags (tag, sample_id) VALUES (?, ?);");
+  if (!stmt)
+    return;
+  for (const auto &tag : split_tags(tags))
+  {
+    sqlite3_bind_text(stmt, 1, tag.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, id);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+      LOG("SQL error inserting tag:", sqlite3_errmsg(writer_.db));
+    sqlite3_reset(stmt);
+  }
+}
+
+void Database::set_tags(long long id, const std::string &tags)
+{
+  if (library_of(id) != 0)
+  {
+    LOG("Samples of attached libraries are read-only:", id);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if (!run(writer_, "BEGIN IMMEDIATE;"))
+    return;
+  bool ok = false;
+  if (auto stmt = writer_.stmts.get("UPDATE sample_files SET tags = ? WHERE ID = ?;"))
+  {
+    sqlite3_bind_text(stmt, 1, tags.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, id);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok)
+      LOG("SQL error updating tags:", sqlite3_errmsg(writer_.db));
+  }
+  if (auto stmt = writer_.stmts.get("DELETE FROM sample_tags WHERE sample_id = ?;"); ok && stmt)
+  {
+    sqlite3_bind_int64(stmt, 1, id);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+  }
+  if (ok)
+  {
+    insert_tags(id, tags);
+    ok = update_smart_folders();
+  }
+  run(writer_, ok ? "COMMIT;" : "ROLLBACK;");
+  writer_idle();
+}
+
+// A folder re-runs its filter only on the samples logged since its position,
+// the few a write touched. One the log no longer reaches back to, or a new
+// one, is filled from the whole library.
+bool Database::update_smart_folders(long long added_after)
+{
+  long long first = 0;
+  long long last = 0;
+  if (auto stmt =
+        writer_.stmts.get("SELECT ifnull(min(seq), 0), ifnull(max(seq), 0) FROM sample_changes;");
+      stmt && sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    first = sqlite3_column_int64(stmt, 0);
+    last = sqlite3_column_int64(stmt, 1);
+  }
+  struct Folder
+  {
+    long long id;
+    std::string filter;
+    long long seq;
+  };
+  std::vector<Folder> folders;
+  if (auto stmt = writer_.stmts.get("SELECT id, filter, seq FROM smart_folders WHERE seq < ? OR ?;"))
+  {
+    sqlite3_bind_int64(stmt, 1, last);
+    sqlite3_bind_int(stmt, 2, added_after > 0);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      folders.push_back(
+        {sqlite3_column_int64(stmt, 0), column_text(stmt, 1), sqlite3_column_int64(stmt, 2)});
+  }
+  // ?1 is the folder and ?2, if given, a position or an ID; the filter's own
+  // parameters follow.
+  auto step = [&](const std::string &sql,
+                  long long id,
+                  std::optional<long long> bound,
+                  const SqlFilter *filter) {
+    auto stmt = writer_.stmts.get(sql);
+    if (!stmt)
+      return false;
+    sqlite3_bind_int64(stmt, 1, id);
+    if (bound)
+      sqlite3_bind_int64(stmt, 2, *bound);
+    if (filter)
+      bind_params(stmt, filter->params, bound ? 3 : 2);
+    if (sqlite3_step(stmt) == SQLITE_DONE)
+      return true;
+    LOG("SQL error updating smart folder:", sqlite3_errmsg(writer_.db));
+    return false;
+  };
+  static const std::string changed = "(SELECT sample_id FROM sample_changes WHERE seq > ?2)";
+  bool ok = true;
+  for (const auto &folder : folders)
   {
-    sqlite3_bind_text(stmt, 1, sample.filepath.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 2, sample.size);
-    sqlite3_bind_double(stmt, 3, sample.duration);
-    sqlite3_bind_int(stmt, 4, sample.sample_rate);
-    sqlite3_bind_int(stmt, 5, sample.bit_depth);
-    sqlite3_bind_int(stmt, 6, sample.channels);
-    sqlite3_bind_text(stmt, 7, sample.tags.c_str(), -1, SQLITE_STATIC);
+    const auto filter = SqlFilter::compile(folder.filter);
+    const auto where = filter.where.empty() ? std::string{} : " AND (" + filter.where + ")";
+    const bool refill = folder.seq < 0 || first > folder.seq + 1;
+    if (refill)
+      ok = ok &&
+           step("DELETE FROM smart_folder_members WHERE folder_id = ?1;", folder.id, {}, nullptr) &&
+           step("INSERT INTO smart_folder_members (folder_id, sample_id)"
+                "  SELECT ?1, ID FROM samples WHERE 1" +
+                  where + ";",
+                folder.id,
+                {},
+                &filter);
+    else if (folder.seq < last)
+      ok = ok &&
+           step("DELETE FROM smart_folder_members WHERE folder_id = ?1 AND sample_id IN " +
+                  changed + ";",
+                folder.id,
+                folder.seq,
+                nullptr) &&
+           step("INSERT OR IGNORE INTO smart_folder_members (folder_id, sample_id)"
+                "  SELECT ?1, ID FROM samples WHERE ID IN " +
+                  changed + where + ";",
+                folder.id,
+                folder.seq,
+                &filter);
+    // Rows added without a log entry, see import_samples().
+    if (added_after > 0 && !refill)
+      ok = ok && step("INSERT INTO smart_folder_members (folder_id, sample_id)"
+                      "  SELECT ?1, ID FROM samples WHERE ID > ?2" +
+                        where + ";",
+                      folder.id,
+                      added_after,
+                      &filter);
+    auto stmt = ok ? writer_.stmts.get("UPDATE smart_folders SET seq = ? WHERE id = ?;")
+                   : StmtCache::Stmt{};
+    if (stmt)
+    {
+      sqlite3_bind_int64(stmt, 1, last);
+      sqlite3_bind_int64(stmt, 2, folder.id);
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+    }
+  }
+  return ok;
+}
 
-    rc = sqlite3_step(stmt);
+bool Database::save_smart_folder(const std::string &name, const std::string &filter)
+{
+  const auto ast = FilterAst::parse(filter);
+  if (name.empty() || name.find('"') != std::string::npos)
+  {
+    LOG("Smart folder names cannot be empty or contain '\"':", name);
+    return false;
+  }
+  // Raw SQL would be spliced into the member queries next to their own
+  // parameters, and could read mem_samples as it was at some earlier refresh.
+  if (!ast.errors.empty() || ast.raw ||
+      std::any_of(ast.terms.begin(), ast.terms.end(), [](const FilterTerm &term) {
+        return term.kind == FilterTerm::Kind::Folder;
+      }))
+  {
+    LOG("Not a filter a smart folder can hold:", filter);
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  if (!run(writer_, "BEGIN IMMEDIATE;"))
+    return false;
+  bool ok = false;
+  if (auto stmt = writer_.stmts.get("INSERT INTO smart_folders (name, filter, seq) VALUES (?, ?, -1)"
+                                    "  ON CONFLICT (name) DO UPDATE SET filter = excluded.filter,"
+                                    "  seq = -1;"))
+  {
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, filter.c_str(), -1, SQLITE_STATIC);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok)
+      LOG("SQL error saving smart folder:", sqlite3_errmsg(writer_.db));
+  }
+  ok = ok && update_smart_folders();
+  run(writer_, ok ? "COMMIT;" : "ROLLBACK;");
+  writer_idle();
+  return ok;
+}
+
+bool Database::delete_smart_folder(const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  bool ok = false;
+  if (auto stmt = writer_.stmts.get("DELETE FROM smart_folders WHERE name = ?;"))
+  {
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok)
+      LOG("SQL error deleting smart folder:", sqlite3_errmsg(writer_.db));
+  }
+  writer_idle();
+  return ok;
+}
+
+std::vector<SmartFolder> Database::smart_folders()
+{
+  std::vector<SmartFolder> ret;
+  auto reader = readers_.acquire();
+  if (auto stmt = reader->stmts.get(
+        "SELECT name, filter,"
+        "  (SELECT COUNT(*) FROM smart_folder_members WHERE folder_id = f.id)"
+        "  FROM smart_folders f ORDER BY name;"))
+  {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      read_record(stmt, ret.emplace_back());
     if (rc != SQLITE_DONE)
+      LOG("SQL error reading smart folders:", sqlite3_errmsg(reader->db));
+  }
+  return ret;
+}
+
+bool Database::set_analysis(long long sample_id,
+                            AnalysisKind kind,
+                            int version,
+                            const std::vector<double> &values,
+                            AnalysisEncoding encoding)
+{
+  if (library_of(sample_id) != 0)
+  {
+    LOG("Samples of attached libraries are read-only:", sample_id);
+    return false;
+  }
+  const auto data = encode_analysis(values, encoding);
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  bool ok = false;
+  // Updating in place keeps the row's id; only samples that exist get one.
+  if (auto stmt = writer_.stmts.get(
+        "INSERT INTO sample_analysis (sample_id, kind, version, data)"
+        "  SELECT ?1, ?2, ?3, ?4 WHERE EXISTS (SELECT 1 FROM sample_files WHERE ID = ?1)"
+        "  ON CONFLICT (sample_id, kind)"
+        "  DO UPDATE SET version = excluded.version, data = excluded.data;"))
+  {
+    sqlite3_bind_int64(stmt, 1, sample_id);
+    sqlite3_bind_int(stmt, 2, static_cast<int>(kind));
+    sqlite3_bind_int(stmt, 3, version);
+    bind_blob(stmt, 4, data);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    if (!ok)
+      LOG("SQL error storing analysis:", sqlite3_errmsg(writer_.db));
+    else if (!sqlite3_changes(writer_.db))
     {
-      LOG("SQL error inserting data:", sqlite3_errmsg(db_));
+      LOG("No sample to store analysis for:", sample_id);
+      ok = false;
     }
-    else
+  }
+  // Not a data change, so writes_ stays; the profiler still gets to flush.
+  if (writer_.on_idle)
+    writer_.on_idle(writer_);
+  return ok;
+}
+
+bool Database::load_analysis(long long sample_id,
+                             AnalysisKind kind,
+                             size_t first,
+                             size_t count,
+                             std::vector<double> &values,
+                             int *version,
+                             size_t *total)
+{
+  values.clear();
+  const size_t library = library_of(sample_id);
+  if (library > libraries_.size())
+    return false;
+  const auto schema = schema_name(library);
+  auto reader = readers_.acquire();
+  // The row lookup and the blob reads see the same snapshot.
+  if (!run(*reader, "BEGIN;"))
+    return false;
+  long long rowid = 0;
+  if (auto stmt = reader->stmts.get("SELECT id, version FROM " + schema +
+                                    ".sample_analysis WHERE sample_id = ? AND kind = ?;"))
+  {
+    sqlite3_bind_int64(stmt, 1, sample_id & ((1LL << library_shift) - 1));
+    sqlite3_bind_int(stmt, 2, static_cast<int>(kind));
+    if (sqlite3_step(stmt) == SQLITE_ROW)
     {
-      LOG("Sample inserted successfully.");
+      rowid = sqlite3_column_int64(stmt, 0);
+      if (version)
+        *version = sqlite3_column_int(stmt, 1);
     }
-    sqlite3_finalize(stmt);
   }
+  bool ok = false;
+  sqlite3_blob *blob = nullptr;
+  if (rowid &&
+      sqlite3_blob_open(reader->db, schema.c_str(), "sample_analysis", "data", rowid, 0, &blob) ==
+        SQLITE_OK)
+  {
+    const size_t size = sqlite3_blob_bytes(blob);
+    auto read = [&](size_t offset, size_t n, void *out) {
+      return sqlite3_blob_read(blob, out, static_cast<int>(n), static_cast<int>(offset)) ==
+             SQLITE_OK;
+    };
+    AnalysisHeader header;
+    ok = read_analysis_header(read, size, header) &&
+         decode_analysis(read, size, first, count, values);
+    if (!ok)
+      LOG("Damaged analysis for sample", sample_id);
+    else if (total)
+      *total = header.count;
+  }
+  else if (rowid)
+    LOG("SQL error opening analysis:", sqlite3_errmsg(reader->db));
+  sqlite3_blob_close(blob);
+  run(*reader, "COMMIT;");
+  return ok;
 }
 
-void Database::scan_directory(const std::string &directory_path)
+// Files a scan inserts at a time, each batch in one transaction through one
+// prepared INSERT. Reading the files happens outside the write lock.
+static const size_t scan_batch_size = 256;
+
+size_t Database::scan_directory(const std::string &directory_path,
+                                QueryToken *token,
+                                const ScanProgress &progress)
 {
   LOG("Scanning directory:", directory_path);
-  for (const auto &entry : std::filesystem::recursive_directory_iterator(directory_path))
+  namespace fs = std::filesystem;
+  std::vector<Sample> batch;
+  size_t added = 0;
+  auto flush = [&] {
+    insert_samples(batch);
+    added += batch.size();
+    batch.clear();
+    if (progress)
+      progress(added);
+  };
+  std::error_code ec;
+  for (fs::recursive_directory_iterator it(directory_path, fs::directory_options::skip_permission_denied, ec), end;
+       !ec && it != end && !(token && token->stopped());
+       it.increment(ec))
   {
-    if (!entry.is_regular_file())
+    if (!it->is_regular_file(ec))
       continue;
-    std::string filepath = entry.path().string();
+    std::string filepath = it->path().string();
     LOG("Found file:", filepath);
     auto new_sample = AudioPlayer::extract_meta_data(filepath.c_str());
     if (new_sample.filepath.empty())
@@ -155,6 +2383,13 @@ void Database::scan_directory(const std::string &directory_path)
       LOG("No audio stream found in:", filepath, "Not inserting into database.");
       continue;
     }
-    insert_sample(new_sample);
+    batch.push_back(std::move(new_sample));
+    if (batch.size() == scan_batch_size)
+      flush();
   }
+  if (ec)
+    LOG("Can't scan", directory_path, ec.message());
+  if (!batch.empty())
+    flush();
+  return added;
 }
@@ -1,19 +1,267 @@
 #pragma once
 
+#include "analysis.h"
+#include "facets.h"
+#include "filter.h"
+#include "query_executor.h"
+#include "query_profiler.h"
+#include "read_pool.h"
 #include "sample.h"
+#include "sample_store.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+// One sample touched since a change-log position, with what a result list
+// needs to update in place: the sort key the row had before (none if it was
+// inserted since) and the row as it is now if it matches the filter.
+struct SampleChange
+{
+  long long id = 0;
+  std::optional<std::string> old_filepath;
+  std::optional<Sample> row;
+};
+
+struct SampleChanges
+{
+  bool complete = true; // false if the log was pruned past the position asked for
+  long long seq = 0;    // position the changes bring the caller up to
+  size_t size = 0;      // rows matching the filter as of seq
+  std::vector<SampleChange> changes;
+};
+
+// A saved filter whose matching samples are stored, see Database::save_smart_folder().
+struct SmartFolder
+{
+  std::string name;
+  std::string filter;
+  size_t size = 0; // members
+  SER_PROPS(name, filter, size);
+};
+
 class Database
 {
 public:
-  Database(const std::string &db_path);
+  enum class Synchronous
+  {
+    Off,
+    Normal, // safe in WAL mode, a power loss may only roll back the last commits
+    Full
+  };
+
+  enum class Checkpoint
+  {
+    Passive,
+    Full,
+    Restart,
+    Truncate
+  };
+
+  // Upkeep run in slices while the app is idle, see maintain().
+  enum class Maintenance
+  {
+    Analyze,           // statistics for tables whose row counts moved
+    Optimize,          // PRAGMA optimize
+    FtsMerge,          // merging FTS index segments
+    IncrementalVacuum, // returning free pages, if auto_vacuum is incremental
+    Checkpoint,        // passive WAL checkpoint
+    SaveSampleStore,   // refreshing the sample store and writing its file
+    Count
+  };
+
+  struct Options
+  {
+    Synchronous synchronous = Synchronous::Normal;
+    int wal_autocheckpoint = 1000; // pages, 0 disables automatic checkpoints
+    long long journal_size_limit = 64 * 1024 * 1024; // bytes kept in the WAL after a checkpoint
+    int read_connections = 3;
+    int busy_timeout_ms = 5000;
+    double slow_query_ms = 50;
+    size_t slow_query_history = 32;
+    long long change_log_size = 10000; // change-log entries kept at startup
+    int backup_step_pages = 256;       // pages copied per backup step
+    int backup_step_sleep_ms = 5;      // pause between backup steps
+    int maintenance_step = 500;        // rows analyzed, FTS pages merged or pages vacuumed per slice
+    // Further library files, attached read-only and queried together with
+    // this one. Their data stays in their own files.
+    std::vector<std::string> libraries;
+  };
+
+  // Samples from attached libraries keep their own IDs with the library's
+  // number, 1 for the first one, above this bit; the main library's are 0.
+  static constexpr int library_shift = 48;
+  static int library_of(long long id) { return static_cast<int>(id >> library_shift); }
+
+  // Pages copied so far and in total.
+  using BackupProgress = std::function<void(int copied, int total)>;
+  // Samples written or read so far and in total.
+  using TransferProgress = std::function<void(size_t done, size_t total)>;
+  // Samples a scan added so far.
+  using ScanProgress = std::function<void(size_t added)>;
+
+  Database(const std::string &db_path) : Database(db_path, Options{}) {}
+  Database(const std::string &db_path, Options options);
   ~Database();
-  void load_samples(std::vector<Sample> &samples_data, std::string where = {});
+  // The read calls take an optional token that can interrupt them or give
+  // them a time budget; check token->stopped() before trusting the result.
+  void load_samples(std::vector<Sample> &samples_data,
+                    const SqlFilter &filter = {},
+                    QueryToken *token = nullptr);
+  // Also reports the change-log position the count is as of.
+  size_t count_samples(const SqlFilter &filter = {},
+                       QueryToken *token = nullptr,
+                       long long *change_seq = nullptr);
+  // Up to `limit` rows in display order that come after `after` (from the
+  // start if null), skipping `offset` of them first.
+  void load_sample_page(std::vector<Sample> &page,
+                        const SqlFilter &filter,
+                        const Sample *after,
+                        size_t offset,
+                        size_t limit,
+                        QueryToken *token = nullptr);
+  // Counts per facet value for the rows matching the filter: the maintained
+  // totals when unfiltered, one grouped pass over the matches otherwise.
+  std::vector<Facet> facets(const SqlFilter &filter = {}, QueryToken *token = nullptr);
+  // Samples changed after change-log position `since`, one entry per sample.
+  SampleChanges sample_changes(long long since, const SqlFilter &filter, QueryToken *token = nullptr);
+  // Moves whenever the data may have changed: after every write through this
+  // object and when another process commits, which PRAGMA data_version shows.
+  unsigned long long generation();
+  // Moves when another process changes an attached library, which the
+  // change log does not cover; lists have to be reloaded then.
+  unsigned long long attached_generation() const { return attached_writes_; }
+  // The libraries that did attach, by number starting at 1.
+  const std::vector<std::string> &libraries() const { return libraries_; }
+  // Writes go to the main library.
   void insert_sample(const Sample &sample);
-  void scan_directory(const std::string &directory_path);
+  // Several at once, in one transaction.
+  void insert_samples(const std::vector<Sample> &samples);
+  // Tags are comma separated; each one is also indexed for tag: filters.
+  // Samples of attached libraries are read-only.
+  void set_tags(long long id, const std::string &tags);
+  // Stores a sample's analysis of the kind, replacing what there was. Not a
+  // sample change, so generation() stays. The blob goes away with the sample.
+  bool set_analysis(long long sample_id,
+                    AnalysisKind kind,
+                    int version,
+                    const std::vector<double> &values,
+                    AnalysisEncoding encoding);
+  // Values [first, first + count) of a sample's analysis, reading only the
+  // part of the blob that holds them. False if there is none; `version` is
+  // the one it was stored with and `total` its number of values.
+  bool load_analysis(long long sample_id,
+                     AnalysisKind kind,
+                     size_t first,
+                     size_t count,
+                     std::vector<double> &values,
+                     int *version = nullptr,
+                     size_t *total = nullptr);
+  // Adds the audio files under the directory a batch at a time, so the list
+  // can pick them up while the scan goes on. A stopped token ends it after the
+  // file at hand, keeping the batches added so far. Returns the number added.
+  size_t scan_directory(const std::string &directory_path,
+                        QueryToken *token = nullptr,
+                        const ScanProgress &progress = nullptr);
+  // Saves the filter under the name, replacing a folder of that name, and
+  // stores the samples it matches. Every write keeps the members current by
+  // checking only the samples it touched, so a folder:"<name>" term reads
+  // them instead of running the filter. Folders hold main library samples
+  // and cannot be sql: filters or contain folder: terms themselves.
+  bool save_smart_folder(const std::string &name, const std::string &filter);
+  bool delete_smart_folder(const std::string &name);
+  std::vector<SmartFolder> smart_folders();
+  bool checkpoint(Checkpoint mode = Checkpoint::Passive);
+  // Runs one bounded slice of the task on the writer and returns whether the
+  // task has more to do. Cancelling the token interrupts the slice.
+  bool maintain(Maintenance task, QueryToken *token = nullptr);
+  // Copies the library to `target` in small steps from one snapshot, for
+  // running on an executor worker while queries and scans carry on. The copy
+  // is checked before it replaces `target`, and is skipped when `target` is
+  // an earlier backup with no sample changes since. Returns false on failure
+  // or when the token stops it.
+  bool backup(const std::string &target,
+              QueryToken *token = nullptr,
+              const BackupProgress &progress = nullptr);
+  // Writes the samples of the main library to `target` as a msgpack stream,
+  // from one snapshot, for import_samples() on another machine. The file only
+  // replaces `target` once complete.
+  bool export_samples(const std::string &target,
+                      QueryToken *token = nullptr,
+                      const TransferProgress &progress = nullptr);
+  // Adds the samples of an export to the main library, with new IDs, in one
+  // transaction that a failure or the token rolls back. Indexes and the
+  // per-row trigger work are built in bulk at the end, and lists reload
+  // afterwards instead of replaying the import from the change log.
+  bool import_samples(const std::string &source,
+                      QueryToken *token = nullptr,
+                      const TransferProgress &progress = nullptr);
+  // Brings the in-memory copy of every sample, which SQL on any connection
+  // reads as the mem_samples table, up to date: from the change log when it
+  // can, otherwise by reading all of them. Returns false if the token stopped it.
+  bool refresh_sample_store(QueryToken *token = nullptr);
+  // Null until the first refresh.
+  std::shared_ptr<const SampleSnapshot> sample_store() const { return sample_store_.get(); }
+  // Maps the sample store file next to the library, if there is one saved
+  // from this library that the change log still reaches back to, so
+  // mem_samples has rows before the first refresh. That refresh then brings
+  // it up to date from the log.
+  bool load_sample_store();
+  // Writes the sample store file if the store moved on since it was written.
+  bool save_sample_store();
+  // Read-only connection for queries that may run alongside writes.
+  ReadPool::Lease reader() { return readers_.acquire(); }
+  size_t stmt_cache_hits() const { return writer_.stmts.hits() + readers_.hits(); }
+  size_t stmt_cache_misses() const { return writer_.stmts.misses() + readers_.misses(); }
+  QueryProfiler &profiler() { return profiler_; }
 
 private:
-  sqlite3 *db_;
+  void migrate();
+  bool migrate_facets();
+  bool migrate_change_log();
+  bool migrate_directories();
+  bool migrate_sort_keys();
+  bool migrate_ranges();
+  bool migrate_path_functions();
+  bool migrate_analysis();
+  bool migrate_smart_folders();
+  bool migrate_library_id();
+  bool migrate_write_count();
+  bool attach_library(sqlite3 *db, const std::string &path, size_t library);
+  // Libraries the filter runs on: all of them, or main only for raw SQL.
+  size_t library_count(const SqlFilter &filter) const;
+  long long directory_id(const std::string &path);
+  long long library_id();
+  // Inserts the rows and their tags through one statement; needs the write
+  // lock and a transaction.
+  bool insert_rows(const std::vector<Sample> &samples);
+  // Brings the smart folders up to the end of the change log, adding the
+  // samples above `added_after` that are not in it; needs the write lock and
+  // a transaction.
+  bool update_smart_folders(long long added_after = 0);
+  void insert_tags(long long id, const std::string &tags);
+  void writer_idle();
+
+  std::string path_;
+  Options options_;
+  QueryProfiler profiler_;
+  SampleStore sample_store_; // outlives the connections it is attached to
+  Connection writer_;
+  std::mutex write_mutex_;
+  std::atomic<unsigned long long> writes_ = 0;
+  std::atomic<unsigned long long> external_writes_ = 0;
+  long long data_version_ = 0; // writer's PRAGMA data_version, under write_mutex_
+  std::vector<std::string> libraries_;
+  std::vector<long long> attached_versions_; // per attached library, under write_mutex_
+  std::atomic<unsigned long long> attached_writes_ = 0;
+  std::unordered_map<std::string, long long> dir_ids_; // directory path to ID, under write_mutex_
+  std::atomic<unsigned long long> sample_store_generation_ = 0; // as of the last refresh
+  std::mutex sample_store_file_mutex_; // one save_sample_store() at a time
+  long long sample_store_saved_seq_ = -1; // change-log position of the file, under the above
+  size_t analyze_next_ = 0; // table the next Analyze slice looks at, under write_mutex_
+  ReadPool readers_;
 };
@@ -0,0 +1,127 @@
+#include "facets.h"
+#include "filter.h"
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+const char *FacetBuilder::key(Field field)
+{
+  static const char *keys[] = {"samplerate", "channels", "bitdepth", "duration", "folder", "tag"};
+  return keys[field];
+}
+
+std::string FacetBuilder::duration_sql(const std::string &column)
+{
+  std::string ret = "CASE";
+  for (size_t i = 0; i < std::size(duration_buckets); ++i)
+    ret += " WHEN " + column + " < " + std::to_string(duration_buckets[i]) + " THEN " +
+           std::to_string(i);
+  return ret + " ELSE " + std::to_string(std::size(duration_buckets)) + " END";
+}
+
+std::string FacetBuilder::folder_sql(const std::string &column)
+{
+  // Trims everything after the last separator.
+  return "rtrim(" + column + ", replace(" + column + ", '/', ''))";
+}
+
+void FacetBuilder::add(Field field, long long value, size_t count)
+{
+  if (count > 0)
+    numbers_[field][value] += count;
+}
+
+void FacetBuilder::add(Field field, const std::string &value, size_t count)
+{
+  if (count > 0)
+    texts_[field][value] += count;
+}
+
+static std::string format(const char *fmt, double value)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), fmt, value);
+  return buf;
+}
+
+static void by_count(std::vector<FacetValue> &values)
+{
+  std::stable_sort(values.begin(), values.end(), [](const auto &a, const auto &b) {
+    return a.count > b.count;
+  });
+}
+
+std::vector<Facet> FacetBuilder::build() const
+{
+  std::vector<Facet> ret;
+  auto numeric = [&](Field field, const char *name, const char *label, const char *term) {
+    Facet facet{name, {}};
+    for (const auto &[value, count] : numbers_[field])
+      facet.values.push_back({format(label, value), format(term, value), count});
+    ret.push_back(std::move(facet));
+  };
+  numeric(SampleRate, "Sample Rate", "%.0f Hz", "sr:%.0f");
+  numeric(Channels, "Channels", "%.0f ch", "ch:%.0f");
+  numeric(BitDepth, "Bit Depth", "%.0f bit", "bits:%.0f");
+
+  Facet duration{"Duration", {}};
+  const size_t buckets = std::size(duration_buckets);
+  for (const auto &[bucket, count] : numbers_[Duration])
+  {
+    if (bucket < 0 || static_cast<size_t>(bucket) > buckets)
+      continue;
+    const auto i = static_cast<size_t>(bucket);
+    if (i == 0)
+      duration.values.push_back({format("< %g s", duration_buckets[0]),
+                                 format("dur<%g", duration_buckets[0]),
+                                 count});
+    else if (i == buckets)
+      duration.values.push_back({format(">= %g s", duration_buckets[i - 1]),
+                                 format("dur>=%g", duration_buckets[i - 1]),
+                                 count});
+    else
+      duration.values.push_back(
+        {format("%g", duration_buckets[i - 1]) + format(" - %g s", duration_buckets[i]),
+         format("dur>=%g", duration_buckets[i - 1]) + format(" dur<%g", duration_buckets[i]),
+         count});
+  }
+  ret.push_back(std::move(duration));
+
+  const auto &dirs = texts_[Folder];
+  std::string prefix;
+  for (auto it = dirs.begin(); it != dirs.end(); ++it)
+  {
+    if (it == dirs.begin())
+      prefix = it->first;
+    else
+      prefix.resize(std::mismatch(prefix.begin(), prefix.end(), it->first.begin(), it->first.end())
+                      .first -
+                    prefix.begin());
+  }
+  prefix.resize(prefix.rfind('/') + 1);
+  std::map<std::string, size_t> tops;
+  for (const auto &[dir, count] : dirs)
+  {
+    const auto rest = dir.substr(prefix.size());
+    tops[rest.substr(0, rest.find('/'))] += count;
+  }
+  Facet folder{"Folder", {}};
+  for (const auto &[top, count] : tops)
+  {
+    // Files right in the shared directory have no narrower folder to pick.
+    if (top.empty())
+      folder.values.push_back({"./", "", count});
+    else
+      folder.values.push_back(
+        {top + "/", "dir:" + FilterAst::quote(prefix + top + "/"), count});
+  }
+  by_count(folder.values);
+  ret.push_back(std::move(folder));
+
+  Facet tag{"Tag", {}};
+  for (const auto &[value, count] : texts_[Tag])
+    tag.values.push_back({value, "tag:" + FilterAst::quote(value), count});
+  by_count(tag.values);
+  ret.push_back(std::move(tag));
+  return ret;
+}
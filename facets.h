@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+struct FacetValue
+{
+  std::string label;
+  std::string term; // filter term that narrows to this value, empty if there is none
+  size_t count = 0;
+};
+
+struct Facet
+{
+  std::string name;
+  std::vector<FacetValue> values;
+};
+
+// Gathers grouped counts, either the maintained totals or a grouped pass over
+// a filter, and turns them into facets for the sidebar. Folders come in per
+// directory and are rolled up to the first level below the directory all of
+// them share, so refining to a folder drills down one level.
+class FacetBuilder
+{
+public:
+  enum Field
+  {
+    SampleRate,
+    Channels,
+    BitDepth,
+    Duration, // bucket index, see duration_buckets
+    Folder,   // parent directory, with the trailing separator
+    Tag,      // lower case
+    FieldCount
+  };
+
+  // Bucket edges in seconds. They are baked into the facet triggers, so
+  // changing them needs a migration.
+  static constexpr double duration_buckets[] = {1, 5, 30};
+
+  // Key of the field in the facet_counts table.
+  static const char *key(Field field);
+  // SQL for the bucket index of a duration and the parent directory of a path.
+  static std::string duration_sql(const std::string &column);
+  static std::string folder_sql(const std::string &column);
+
+  void add(Field field, long long value, size_t count);
+  void add(Field field, const std::string &value, size_t count);
+  std::vector<Facet> build() const;
+
+private:
+  std::map<long long, size_t> numbers_[FieldCount];
+  std::map<std::string, size_t> texts_[FieldCount];
+};
@@ -0,0 +1,436 @@
+#include "filter.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::string to_lower(std::string s)
+{
+  std::transform(
+    s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return s;
+}
+
+static bool is_token_char(unsigned char c)
+{
+  // Matches the unicode61 tokenizer closely enough: ASCII alphanumerics plus
+  // anything non-ASCII.
+  return std::isalnum(c) || c >= 0x80;
+}
+
+static bool has_token_chars(const std::string &s)
+{
+  return std::any_of(s.begin(), s.end(), [](unsigned char c) { return is_token_char(c); });
+}
+
+// Drops the quotes around a value, the closing one being optional, and turns
+// each doubled quote inside into one (see FilterAst::quote()).
+static std::string unquote(const std::string &s)
+{
+  if (s.empty() || s.front() != '"')
+    return s;
+  const size_t end = s.size() >= 2 && s.back() == '"' ? s.size() - 1 : s.size();
+  std::string ret;
+  for (size_t i = 1; i < end; ++i)
+  {
+    ret += s[i];
+    if (s[i] == '"' && i + 1 < end && s[i + 1] == '"')
+      ++i;
+  }
+  return ret;
+}
+
+static bool parse_number(const std::string &s, double &out)
+{
+  if (s.empty())
+    return false;
+  char *end = nullptr;
+  out = std::strtod(s.c_str(), &end);
+  return end == s.c_str() + s.size();
+}
+
+static const struct
+{
+  const char *name;
+  const char *column;
+} numeric_fields[] = {
+  {"dur", "duration"},
+  {"duration", "duration"},
+  {"sr", "samplerate"},
+  {"rate", "samplerate"},
+  {"samplerate", "samplerate"},
+  {"ch", "channels"},
+  {"channels", "channels"},
+  {"bits", "bitdepth"},
+  {"depth", "bitdepth"},
+  {"bitdepth", "bitdepth"},
+  {"size", "size"},
+};
+
+static std::vector<std::string> tokenize(const std::string &text)
+{
+  std::vector<std::string> tokens;
+  std::string token;
+  bool quoted = false;
+  for (char c : text)
+  {
+    if (c == '"')
+      quoted = !quoted;
+    if (!quoted && std::isspace(static_cast<unsigned char>(c)))
+    {
+      if (!token.empty())
+        tokens.push_back(std::move(token));
+      token.clear();
+      continue;
+    }
+    token += c;
+  }
+  if (!token.empty())
+    tokens.push_back(std::move(token));
+  return tokens;
+}
+
+static void parse_field(FilterAst &ast, FilterTerm term, const std::string &name, std::string rest)
+{
+  const std::string op_chars = rest.substr(0, rest.find_first_not_of("<>=:"));
+  const std::string value = unquote(rest.substr(op_chars.size()));
+  if (name == "tag" || name == "tags" || name == "path" || name == "dir" || name == "ext" ||
+      name == "folder")
+  {
+    if (op_chars != ":" && op_chars != "=")
+    {
+      ast.errors.push_back(name + " only supports ':'");
+      return;
+    }
+    term.kind = name == "path"     ? FilterTerm::Kind::Path
+                : name == "dir"    ? FilterTerm::Kind::Dir
+                : name == "ext"    ? FilterTerm::Kind::Ext
+                : name == "folder" ? FilterTerm::Kind::Folder
+                                   : FilterTerm::Kind::Tag;
+    term.text = value;
+    if (term.kind == FilterTerm::Kind::Dir && !term.text.empty() && term.text.back() != '/')
+      term.text += '/';
+    if (term.kind == FilterTerm::Kind::Ext)
+      term.text = to_lower(term.text.substr(term.text.rfind('.') + 1));
+    if (!term.text.empty())
+      ast.terms.push_back(std::move(term));
+    return;
+  }
+
+  auto field = std::find_if(std::begin(numeric_fields), std::end(numeric_fields), [&](const auto &f) {
+    return name == f.name;
+  });
+  if (field == std::end(numeric_fields))
+  {
+    ast.errors.push_back("unknown field '" + name + "'");
+    return;
+  }
+  term.kind = FilterTerm::Kind::Number;
+  term.column = field->column;
+  if (op_chars == ":" || op_chars == "=")
+    term.op = FilterTerm::Op::Eq;
+  else if (op_chars == "<")
+    term.op = FilterTerm::Op::Lt;
+  else if (op_chars == "<=")
+    term.op = FilterTerm::Op::Le;
+  else if (op_chars == ">")
+    term.op = FilterTerm::Op::Gt;
+  else if (op_chars == ">=")
+    term.op = FilterTerm::Op::Ge;
+  else
+  {
+    ast.errors.push_back("bad operator '" + op_chars + "' for " + name);
+    return;
+  }
+
+  const auto dots = value.find("..");
+  if (dots != std::string::npos && term.op == FilterTerm::Op::Eq)
+  {
+    term.op = FilterTerm::Op::Range;
+    if (!parse_number(value.substr(0, dots), term.value) ||
+        !parse_number(value.substr(dots + 2), term.value_hi))
+    {
+      ast.errors.push_back("bad range '" + value + "' for " + name);
+      return;
+    }
+  }
+  else if (!parse_number(value, term.value))
+  {
+    ast.errors.push_back("bad number '" + value + "' for " + name);
+    return;
+  }
+  ast.terms.push_back(std::move(term));
+}
+
+FilterAst FilterAst::parse(const std::string &text)
+{
+  FilterAst ast;
+  const auto start = text.find_first_not_of(" \t");
+  if (start != std::string::npos && text.compare(start, 4, "sql:") == 0)
+  {
+    ast.raw = true;
+    ast.raw_sql = text.substr(start + 4);
+    return ast;
+  }
+
+  for (auto token : tokenize(text))
+  {
+    FilterTerm term;
+    if (token.size() > 1 && token[0] == '-')
+    {
+      term.negate = true;
+      token.erase(0, 1);
+    }
+
+    size_t name_len = 0;
+    while (name_len < token.size() && std::isalpha(static_cast<unsigned char>(token[name_len])))
+      ++name_len;
+    if (name_len > 0 && name_len < token.size() && std::strchr("<>=:", token[name_len]))
+    {
+      parse_field(ast, std::move(term), to_lower(token.substr(0, name_len)), token.substr(name_len));
+      continue;
+    }
+
+    term.kind = token.front() == '"' ? FilterTerm::Kind::Phrase : FilterTerm::Kind::Text;
+    term.text = unquote(token);
+    if (has_token_chars(term.text))
+      ast.terms.push_back(std::move(term));
+  }
+  return ast;
+}
+
+std::string FilterAst::normalized() const
+{
+  if (raw)
+    return "sql:" + raw_sql;
+  std::vector<std::string> keys;
+  for (const auto &term : terms)
+  {
+    // Words and paths are compared case-insensitively when the filter runs.
+    const bool fold = term.kind == FilterTerm::Kind::Text ||
+                      term.kind == FilterTerm::Kind::Phrase || term.kind == FilterTerm::Kind::Path;
+    // A range matches the same rows whichever way round its ends were typed.
+    const bool range = term.op == FilterTerm::Op::Range;
+    char bounds[64];
+    snprintf(bounds,
+             sizeof(bounds),
+             "%.17g %.17g",
+             range ? std::min(term.value, term.value_hi) : term.value,
+             range ? std::max(term.value, term.value_hi) : 0.0);
+    keys.push_back(std::to_string(static_cast<int>(term.kind)) + (term.negate ? "-" : "+") +
+                   term.column + " " + std::to_string(static_cast<int>(term.op)) + " " +
+                   (term.kind == FilterTerm::Kind::Number ? bounds : "") + " " +
+                   (fold ? to_lower(term.text) : term.text));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  std::string ret;
+  for (const auto &key : keys)
+    ret += key + "\n";
+  return ret;
+}
+
+static std::string fts_string(const std::string &s)
+{
+  std::string ret = "\"";
+  for (char c : s)
+  {
+    if (c == '"')
+      ret += '"';
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+// Quoted values double their quotes the way FTS5 strings do.
+std::string FilterAst::quote(const std::string &value)
+{
+  return value.find_first_of(" \t\n\v\f\r\"") == std::string::npos ? value : fts_string(value);
+}
+
+std::string SqlFilter::where_in(const std::string &schema) const
+{
+  if (raw || schema == "main")
+    return where;
+  // Every value is a parameter, so "main." only ever qualifies a table.
+  // Smart folders hold main library samples, so elsewhere a folder has no
+  // members rather than reading the other library's folder of that name.
+  static const std::string members = "main.smart_folder_members";
+  std::string ret;
+  size_t pos = 0;
+  for (size_t found; (found = where.find("main.", pos)) != std::string::npos;)
+  {
+    ret += where.substr(pos, found - pos);
+    if (where.compare(found, members.size(), members) == 0)
+    {
+      ret += "(SELECT 0 AS folder_id, 0 AS sample_id WHERE 0)";
+      pos = found + members.size();
+    }
+    else
+    {
+      ret += schema + ".";
+      pos = found + 5;
+    }
+  }
+  return ret + where.substr(pos);
+}
+
+SqlFilter SqlFilter::compile(const FilterAst &ast)
+{
+  SqlFilter ret;
+  if (ast.raw)
+  {
+    ret.where = ast.raw_sql;
+    ret.raw = true;
+    return ret;
+  }
+
+  std::vector<std::string> conds;
+  std::vector<SqlValue> params;
+  std::string match;     // FTS5 query every row must match
+  std::string not_match; // FTS5 query no row may match
+  auto add = [](std::string &query, const std::string &expr, const char *sep) {
+    query += (query.empty() ? "" : sep) + expr;
+  };
+
+  // Ranges on two or more numeric fields are one box in the sample_ranges
+  // R*Tree, which has a <column>_lo and <column>_hi pair per field, instead
+  // of one B-tree range and a check on every row in it.
+  std::vector<std::string> range_columns;
+  for (const auto &term : ast.terms)
+    if (term.kind == FilterTerm::Kind::Number && !term.negate &&
+        std::find(range_columns.begin(), range_columns.end(), term.column) == range_columns.end())
+      range_columns.push_back(term.column);
+  const bool use_ranges = range_columns.size() >= 2;
+  std::string ranges;
+  std::vector<SqlValue> range_params;
+
+  for (const auto &term : ast.terms)
+  {
+    switch (term.kind)
+    {
+    case FilterTerm::Kind::Text:
+    case FilterTerm::Kind::Phrase: {
+      // Bare words match as prefixes so the last word can still be typed.
+      const auto expr =
+        fts_string(term.text) + (term.kind == FilterTerm::Kind::Text ? "*" : "");
+      if (term.negate)
+        add(not_match, expr, " OR ");
+      else
+        add(match, expr, " AND ");
+      break;
+    }
+    case FilterTerm::Kind::Tag:
+      conds.push_back(std::string{"ID "} + (term.negate ? "NOT IN" : "IN") +
+                      " (SELECT sample_id FROM main.sample_tags WHERE tag = ?)");
+      params.push_back(term.text);
+      break;
+    case FilterTerm::Kind::Path:
+      // A value that starts and ends on a separator is a run of whole path
+      // tokens, so the FTS index can narrow the rows before the exact check.
+      if (!term.negate && has_token_chars(term.text) && !is_token_char(term.text.front()) &&
+          !is_token_char(term.text.back()))
+        add(match, "filepath : " + fts_string(term.text), " AND ");
+      conds.push_back(std::string{"instr(lower(filepath), ?) "} + (term.negate ? "= 0" : "> 0"));
+      params.push_back(to_lower(term.text));
+      break;
+    case FilterTerm::Kind::Dir: {
+      // Paths under the folder sort between "<folder>/" and "<folder>0", the
+      // character after the separator, so the subtree is one index range.
+      auto end = term.text;
+      end.back() = '/' + 1;
+      conds.push_back(std::string{"dir_id "} + (term.negate ? "NOT IN" : "IN") +
+                      " (SELECT id FROM main.directories WHERE path >= ? AND path < ?)");
+      params.push_back(term.text);
+      params.push_back(end);
+      break;
+    }
+    case FilterTerm::Kind::Ext:
+      // Lands on the path_ext(name) index behind the column.
+      conds.push_back(std::string{"ext "} + (term.negate ? "<>" : "=") + " ?");
+      params.push_back(term.text);
+      break;
+    case FilterTerm::Kind::Folder:
+      // The members are stored and kept current, see Database::save_smart_folder().
+      conds.push_back(std::string{"ID "} + (term.negate ? "NOT IN" : "IN") +
+                      " (SELECT sample_id FROM main.smart_folder_members WHERE folder_id ="
+                      " (SELECT id FROM main.smart_folders WHERE name = ?))");
+      params.push_back(term.text);
+      break;
+    case FilterTerm::Kind::Number: {
+      static const char *ops[] = {"=", "<", "<=", ">", ">="};
+      const double lo = std::min(term.value, term.value_hi);
+      const double hi = std::max(term.value, term.value_hi);
+      const bool boxed = use_ranges && !term.negate;
+      if (boxed)
+      {
+        // The R*Tree stores 32-bit floats rounded outwards, so its box can
+        // only let extra rows through; the exact check below removes them.
+        const auto lo_col = term.column + "_lo";
+        const auto hi_col = term.column + "_hi";
+        switch (term.op)
+        {
+        case FilterTerm::Op::Eq:
+          add(ranges, lo_col + " <= ? AND " + hi_col + " >= ?", " AND ");
+          range_params.insert(range_params.end(), {term.value, term.value});
+          break;
+        case FilterTerm::Op::Lt:
+        case FilterTerm::Op::Le:
+          add(ranges, lo_col + " " + ops[static_cast<int>(term.op)] + " ?", " AND ");
+          range_params.push_back(term.value);
+          break;
+        case FilterTerm::Op::Gt:
+        case FilterTerm::Op::Ge:
+          add(ranges, hi_col + " " + ops[static_cast<int>(term.op)] + " ?", " AND ");
+          range_params.push_back(term.value);
+          break;
+        case FilterTerm::Op::Range:
+          add(ranges, hi_col + " >= ? AND " + lo_col + " <= ?", " AND ");
+          range_params.insert(range_params.end(), {lo, hi});
+          break;
+        }
+      }
+      // With the box in place, a unary '+' keeps the column's own index out
+      // of the plan.
+      std::string cond = (boxed ? "+" : "") + term.column;
+      if (term.op == FilterTerm::Op::Range)
+      {
+        cond += " BETWEEN ? AND ?";
+        params.push_back(lo);
+        params.push_back(hi);
+      }
+      else
+      {
+        cond += std::string{" "} + ops[static_cast<int>(term.op)] + " ?";
+        params.push_back(term.value);
+      }
+      conds.push_back(term.negate ? "NOT (" + cond + ")" : cond);
+      break;
+    }
+    }
+  }
+
+  // The R*Tree and FTS subqueries go first so their parameters lead.
+  if (!ranges.empty())
+  {
+    conds.insert(conds.begin(), "ID IN (SELECT id FROM main.sample_ranges WHERE " + ranges + ")");
+    params.insert(params.begin(), range_params.begin(), range_params.end());
+  }
+  if (!not_match.empty())
+  {
+    conds.insert(conds.begin(),
+                 "ID NOT IN (SELECT rowid FROM main.samples_fts WHERE samples_fts MATCH ?)");
+    params.insert(params.begin(), not_match);
+  }
+  if (!match.empty())
+  {
+    conds.insert(conds.begin(), "ID IN (SELECT rowid FROM main.samples_fts WHERE samples_fts MATCH ?)");
+    params.insert(params.begin(), match);
+  }
+
+  for (const auto &cond : conds)
+    ret.where += (ret.where.empty() ? "" : " AND ") + cond;
+  ret.params = std::move(params);
+  return ret;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <variant>
+#include <vector>
+
+// Filter box language. Terms are separated by spaces and all of them must
+// match; a leading '-' negates a term.
+//
+//   kick "door knock"   words (prefix) and phrases in the path or tags
+//   dur<0.5 sr:48000    numeric fields: dur, sr, ch, bits, size with
+//   ch:1 dur:0.2..1.5   ':' '=' '<' '<=' '>' '>=' or a lo..hi range
+//   tag:impact          exact tag
+//   path:/Foley/        case-insensitive path substring
+//   dir:/mnt/lib/Foley  everything under a folder, by absolute path
+//   ext:wav             file extension, case-insensitive
+//   folder:"Short hits" members of a saved smart folder
+//   sql:<expression>    the rest of the box is a raw WHERE clause
+//
+// A quoted value keeps its spaces; a quote inside one is written twice, as in
+// tag:"12"" vinyl".
+struct FilterTerm
+{
+  enum class Kind
+  {
+    Text,
+    Phrase,
+    Tag,
+    Path,
+    Dir,
+    Ext,
+    Number,
+    Folder
+  };
+  enum class Op
+  {
+    Eq,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    Range
+  };
+
+  Kind kind = Kind::Text;
+  bool negate = false;
+  std::string column; // Number only
+  std::string text;
+  Op op = Op::Eq;
+  double value = 0;
+  double value_hi = 0; // Range only
+};
+
+struct FilterAst
+{
+  std::vector<FilterTerm> terms;
+  bool raw = false;
+  std::string raw_sql;
+  std::vector<std::string> errors;
+
+  // The same string for filters that only differ in term order, repeated
+  // terms or the case of words and paths, which match the same rows.
+  std::string normalized() const;
+
+  static FilterAst parse(const std::string &text);
+  // A value as a term reads it back: in quotes, with any quote in it doubled,
+  // if it holds whitespace or a quote.
+  static std::string quote(const std::string &value);
+};
+
+using SqlValue = std::variant<long long, double, std::string>;
+
+// WHERE clause with positional parameters, bound in order. Compiled filters
+// name the tables they look into as main.<table>, so the same clause can run
+// against an attached library; raw ones are left as typed.
+struct SqlFilter
+{
+  std::string where;
+  std::vector<SqlValue> params;
+  bool raw = false; // from sql:, runs on the main library only
+
+  // The clause with its tables in `schema` instead of main; folder: terms
+  // match no sample there.
+  std::string where_in(const std::string &schema) const;
+
+  static SqlFilter compile(const FilterAst &ast);
+  static SqlFilter compile(const std::string &text) { return compile(FilterAst::parse(text)); }
+};
@@ -0,0 +1,109 @@
+#include "front_coded.h"
+#include <algorithm>
+
+// Entry layout: varint shared prefix length (left out for the first string of
+// a block), varint length of the rest, the rest.
+
+static void put_varint(std::vector<char> &out, size_t v)
+{
+  for (; v >= 0x80; v >>= 7)
+    out.push_back(static_cast<char>(v | 0x80));
+  out.push_back(static_cast<char>(v));
+}
+
+static size_t get_varint(const PodArray<char> &in, size_t &pos)
+{
+  size_t v = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    const auto byte = static_cast<unsigned char>(in[pos++]);
+    v |= static_cast<size_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return v;
+  }
+}
+
+// get_varint() for bytes that may not be a varint: false if it would run past
+// the end or overflow.
+static bool get_varint_checked(const PodArray<char> &in, size_t &pos, size_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift < 64 && pos < in.size(); shift += 7)
+  {
+    const auto byte = static_cast<unsigned char>(in[pos++]);
+    v |= static_cast<size_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+void FrontCodedStrings::append(std::string_view prev, std::string_view s)
+{
+  auto &data = data_.owned();
+  text_size_ += s.size();
+  if (size_ % block_size == 0)
+    blocks_.owned().push_back(data.size());
+  else
+  {
+    const auto shared = std::mismatch(prev.begin(), prev.end(), s.begin(), s.end()).first;
+    const size_t prefix = shared - prev.begin();
+    put_varint(data, prefix);
+    s.remove_prefix(prefix);
+  }
+  put_varint(data, s.size());
+  data.insert(data.end(), s.begin(), s.end());
+  ++size_;
+}
+
+std::string_view FrontCodedStrings::Reader::operator[](size_t idx)
+{
+  if (idx == idx_)
+    return current_;
+  const auto &data = strings_->data_;
+  // From the start of the block unless idx follows on from the last one in it.
+  size_t i = idx_ + 1;
+  if (idx_ == SIZE_MAX || idx < i || idx / block_size != idx_ / block_size)
+  {
+    i = idx - idx % block_size;
+    next_ = strings_->blocks_[i / block_size];
+  }
+  for (; i <= idx; ++i)
+  {
+    size_t pos = next_;
+    const size_t prefix = i % block_size == 0 ? 0 : get_varint(data, pos);
+    const size_t rest = get_varint(data, pos);
+    current_.resize(prefix);
+    current_.append(data.data() + pos, rest);
+    next_ = pos + rest;
+  }
+  idx_ = idx;
+  return current_;
+}
+
+bool FrontCodedStrings::valid() const
+{
+  if (blocks_.size() != (size_ + block_size - 1) / block_size)
+    return false;
+  size_t pos = 0;
+  size_t prev = 0; // length of the string before
+  size_t text = 0;
+  for (size_t i = 0; i < size_; ++i)
+  {
+    size_t prefix = 0;
+    size_t rest = 0;
+    if (i % block_size == 0)
+    {
+      if (blocks_[i / block_size] != pos)
+        return false;
+    }
+    else if (!get_varint_checked(data_, pos, prefix) || prefix > prev)
+      return false;
+    if (!get_varint_checked(data_, pos, rest) || rest > data_.size() - pos)
+      return false;
+    pos += rest;
+    prev = prefix + rest;
+    text += prev;
+  }
+  return pos == data_.size() && text == text_size_;
+}
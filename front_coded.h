@@ -0,0 +1,76 @@
+#pragma once
+
+#include "pod_array.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Strings in sorted order, front coded: each block of `block_size` starts with
+// its first string whole and stores every other one as the length of the
+// prefix it shares with the one before, followed by the rest. Any string is
+// found by decoding part of one block; reading them in order decodes each one
+// from the one before. Never changes once built.
+class FrontCodedStrings
+{
+public:
+  static constexpr size_t block_size = 16;
+
+  FrontCodedStrings() = default;
+  // The strings at(0) to at(count - 1), which should be sorted for them to
+  // share prefixes.
+  template <typename At>
+  FrontCodedStrings(size_t count, At at)
+  {
+    blocks_.owned().reserve((count + block_size - 1) / block_size);
+    std::string_view prev;
+    for (size_t i = 0; i < count; ++i)
+    {
+      const std::string_view s = at(i);
+      append(i % block_size == 0 ? std::string_view{} : prev, s);
+      prev = s;
+    }
+    data_.owned().shrink_to_fit();
+  }
+  // The parts data() and blocks() returned, with size() and text_size().
+  FrontCodedStrings(PodArray<char> data, PodArray<uint64_t> blocks, size_t size, size_t text_size)
+    : data_(std::move(data)), blocks_(std::move(blocks)), size_(size), text_size_(text_size)
+  {
+  }
+
+  size_t size() const { return size_; }
+  // Bytes the strings take decoded.
+  size_t text_size() const { return text_size_; }
+  // Bytes they take encoded, offsets included.
+  size_t bytes() const { return data_.size() + blocks_.size() * sizeof(uint64_t); }
+  const PodArray<char> &data() const { return data_; }
+  const PodArray<uint64_t> &blocks() const { return blocks_; }
+  // Whether the parts decode within their bounds to size() strings of
+  // text_size() bytes, for parts read from outside such as a file. Reads all
+  // of them.
+  bool valid() const;
+
+  // Decodes strings, keeping the last one so the next in order comes cheap.
+  class Reader
+  {
+  public:
+    explicit Reader(const FrontCodedStrings &strings) : strings_(&strings) {}
+    // Good until the next call.
+    std::string_view operator[](size_t idx);
+
+  private:
+    const FrontCodedStrings *strings_;
+    std::string current_;
+    size_t idx_ = SIZE_MAX;
+    size_t next_ = 0; // byte offset of the string after idx_
+  };
+
+private:
+  void append(std::string_view prev, std::string_view s);
+
+  PodArray<char> data_;
+  PodArray<uint64_t> blocks_; // byte offset of each block
+  size_t size_ = 0;
+  size_t text_size_ = 0;
+};
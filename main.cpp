@@ -2,6 +2,7 @@
 #include "audio_player.h"
 #include "database.h"
 #include "sample.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <limits>
@@ -23,7 +24,10 @@ struct Cfg
   SER_PROPS(window_x, window_y, window_w, window_h, filter, selected_sample_idx);
 };
 
-int main(int /*argc*/, char ** /*argv*/)
+// sfx-db [library.db ...]: the first library, sfx.db by default, is the one
+// scans and tag edits go to; the others are attached read-only and searched
+// along with it.
+int main(int argc, char **argv)
 {
   try
   {
@@ -44,9 +48,11 @@ int main(int /*argc*/, char ** /*argv*/)
         msgpackDeser(ifs, cfg);
     }
 
-    Database db("sfx.db");
-    std::vector<Sample> samples_data;
-    db.load_samples(samples_data);
+    Database::Options options;
+    options.libraries.assign(argv + std::min(argc, 2), argv + argc);
+    Database db(argc > 1 ? argv[1] : "sfx.db", options);
+    // The list pages from SQL; this gives mem_samples its rows up front.
+    db.load_sample_store();
 
     sdl::Init sdl(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
 
@@ -59,7 +65,7 @@ int main(int /*argc*/, char ** /*argv*/)
 
     auto gl_context = SDL_GL_CreateContext(window.get());
 
-    Ui ui(window, gl_context, db, samples_data, cfg.filter, cfg.selected_sample_idx);
+    Ui ui(window, gl_context, db, cfg.filter, cfg.selected_sample_idx);
 
     while (ui.isRunning())
     {
@@ -71,6 +77,7 @@ int main(int /*argc*/, char ** /*argv*/)
 
       ui.render();
     }
+    db.save_sample_store();
 
     std::ofstream ofs(config_file_path);
     if (ofs.is_open())
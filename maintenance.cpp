@@ -0,0 +1,66 @@
+#include "maintenance.h"
+
+MaintenanceScheduler::MaintenanceScheduler(Database &db, QueryExecutor &executor)
+  : db_(db), executor_(executor)
+{
+}
+
+const char *MaintenanceScheduler::name(Database::Maintenance task)
+{
+  static const char *names[] = {
+    "Analyze", "Optimize", "FTS merge", "Incremental vacuum", "Checkpoint", "Save sample store"};
+  return task < Database::Maintenance::Count ? names[static_cast<int>(task)] : "";
+}
+
+void MaintenanceScheduler::tick(bool idle)
+{
+  if (!idle)
+  {
+    // A slice cancelled before it started is dropped without a completion,
+    // so it is let go of here rather than waited for.
+    if (token_)
+      token_->cancel();
+    token_ = nullptr;
+    return;
+  }
+  if (token_)
+    return;
+
+  if (!in_round_)
+  {
+    const auto generation = db_.generation();
+    if (ran_ && generation == generation_)
+      return;
+    in_round_ = true;
+    task_ = 0;
+  }
+  if (task_ == static_cast<int>(Database::Maintenance::Count))
+  {
+    // Writes that land during the round bring on another one.
+    in_round_ = false;
+    ran_ = true;
+    generation_ = db_.generation();
+    return;
+  }
+
+  token_ = std::make_shared<QueryToken>();
+  const auto task = static_cast<Database::Maintenance>(task_);
+  executor_.submit(
+    [this, &db = db_, &executor = executor_, token = token_, task](QueryToken &) {
+      const auto start = std::chrono::steady_clock::now();
+      const bool more = db.maintain(task, token.get());
+      const std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+      executor.post([this, token, task, more, ms = ms.count()] {
+        Run run{task, ms, !more && !token->cancelled(), token->cancelled()};
+        history_.push_front(run);
+        if (history_.size() > history_size)
+          history_.pop_back();
+        if (token != token_)
+          return;
+        token_ = nullptr;
+        if (run.done)
+          ++task_;
+      });
+    },
+    token_);
+}
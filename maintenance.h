@@ -0,0 +1,46 @@
+#pragma once
+
+#include "database.h"
+#include "query_executor.h"
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+
+// Runs Database::maintain() while the app is idle: once the data has changed
+// since the last round it goes through every task, one slice per executor
+// job, a task at a time until it reports nothing left. A tick that is not
+// idle cancels the slice in flight, interrupting its statement, and the
+// round picks up from the same task once idle again. Lives on the UI thread.
+class MaintenanceScheduler
+{
+public:
+  static constexpr size_t history_size = 64;
+
+  struct Run
+  {
+    Database::Maintenance task;
+    double ms = 0;
+    bool done = false;        // the task had nothing left after this slice
+    bool interrupted = false; // preempted by user activity
+  };
+
+  MaintenanceScheduler(Database &db, QueryExecutor &executor);
+  // Call once per frame.
+  void tick(bool idle);
+  bool busy() const { return token_ != nullptr; }
+  // Most recent slice first.
+  const std::deque<Run> &history() const { return history_; }
+
+  static const char *name(Database::Maintenance task);
+
+private:
+  Database &db_;
+  QueryExecutor &executor_;
+  std::shared_ptr<QueryToken> token_; // slice in flight
+  bool in_round_ = false;
+  int task_ = 0; // next task of the round
+  unsigned long long generation_ = 0; // database generation the last round finished at
+  bool ran_ = false;                  // whether a round has finished at all
+  std::deque<Run> history_;
+};
@@ -0,0 +1,72 @@
+#include "natural_sort.h"
+#include <algorithm>
+
+static bool is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static char fold(char c)
+{
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Significant digits of the run starting at pos, and where the run ends.
+static std::string_view digits(std::string_view text, size_t &pos)
+{
+  const size_t start = pos;
+  while (pos < text.size() && is_digit(text[pos]))
+    ++pos;
+  auto run = text.substr(start, pos - start);
+  run.remove_prefix(std::min(run.find_first_not_of('0'), run.size()));
+  // The length has to fit the one byte it is stored in.
+  return run.substr(0, 255);
+}
+
+std::string natural_key(std::string_view text)
+{
+  std::string ret;
+  ret.reserve(text.size() + 8);
+  for (size_t pos = 0; pos < text.size();)
+  {
+    if (!is_digit(text[pos]))
+    {
+      ret += fold(text[pos++]);
+      continue;
+    }
+    const auto run = digits(text, pos);
+    ret += '0';
+    ret += static_cast<char>(run.size());
+    ret += run;
+  }
+  return ret;
+}
+
+int natural_compare(std::string_view a, std::string_view b)
+{
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.size() && j < b.size())
+  {
+    if (is_digit(a[i]) && is_digit(b[j]))
+    {
+      const auto x = digits(a, i);
+      const auto y = digits(b, j);
+      if (x.size() != y.size())
+        return x.size() < y.size() ? -1 : 1;
+      if (int cmp = x.compare(y))
+        return cmp < 0 ? -1 : 1;
+      continue;
+    }
+    // A digit run sorts as '0' against anything else.
+    const auto x = static_cast<unsigned char>(is_digit(a[i]) ? '0' : fold(a[i]));
+    const auto y = static_cast<unsigned char>(is_digit(b[j]) ? '0' : fold(b[j]));
+    if (x != y)
+      return x < y ? -1 : 1;
+    ++i;
+    ++j;
+  }
+  if (i < a.size())
+    return 1;
+  return j < b.size() ? -1 : 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Natural, case-insensitive order: "kick 2.wav" before "Kick 10.wav". The key
+// of a string compares byte-wise (memcmp, then length) in that order, so it
+// can be stored in a BLOB column and indexed. ASCII letters are folded to
+// lower case and each run of digits becomes '0', the number of significant
+// digits and the digits, which puts longer numbers after shorter ones. Numbers
+// that only differ in leading zeros get the same key.
+std::string natural_key(std::string_view text);
+
+// Compares like the keys of a and b, without building them.
+int natural_compare(std::string_view a, std::string_view b);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+// A contiguous array that either owns its elements or views ones held
+// elsewhere, such as in a mapped file. Only an owning array can be changed,
+// through owned().
+template <typename T>
+class PodArray
+{
+  static_assert(std::is_trivially_copyable_v<T>, "elements are stored as raw bytes");
+
+public:
+  PodArray() = default;
+  // Views `size` elements at `data`, which have to outlive the array.
+  PodArray(const T *data, size_t size) : view_(data), size_(size) {}
+  PodArray(PodArray &&) = default;
+  PodArray &operator=(PodArray &&) = default;
+
+  const T *data() const { return view_ ? view_ : owned_.data(); }
+  size_t size() const { return view_ ? size_ : owned_.size(); }
+  bool empty() const { return size() == 0; }
+  const T &operator[](size_t idx) const { return data()[idx]; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + size(); }
+  std::vector<T> &owned() { return owned_; }
+
+private:
+  std::vector<T> owned_;
+  const T *view_ = nullptr;
+  size_t size_ = 0;
+};
@@ -0,0 +1,92 @@
+#include "query_executor.h"
+#include <algorithm>
+
+void QueryToken::cancel()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  cancelled_.store(true, std::memory_order_relaxed);
+  if (db_)
+    sqlite3_interrupt(db_);
+}
+
+void QueryToken::attach(sqlite3 *db)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  db_ = db;
+}
+
+void QueryToken::detach()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  db_ = nullptr;
+}
+
+QueryExecutor::QueryExecutor(size_t threads)
+{
+  for (size_t i = 0; i < threads; ++i)
+    threads_.emplace_back([this] { worker(); });
+}
+
+QueryExecutor::~QueryExecutor()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (auto &token : running_)
+      token->cancel();
+  }
+  cv_.notify_all();
+  for (auto &thread : threads_)
+    thread.join();
+}
+
+std::shared_ptr<QueryToken> QueryExecutor::submit(Job job, std::shared_ptr<QueryToken> token)
+{
+  if (!token)
+    token = std::make_shared<QueryToken>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.emplace_back(std::move(job), token);
+  }
+  cv_.notify_one();
+  return token;
+}
+
+void QueryExecutor::post(std::function<void()> completion)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  completions_.push_back(std::move(completion));
+}
+
+void QueryExecutor::poll()
+{
+  std::vector<std::function<void()>> completions;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    completions.swap(completions_);
+  }
+  for (auto &completion : completions)
+    completion();
+}
+
+void QueryExecutor::worker()
+{
+  for (;;)
+  {
+    std::pair<Job, std::shared_ptr<QueryToken>> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (stopping_)
+        return;
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+      if (job.second->cancelled())
+        continue;
+      running_.push_back(job.second);
+    }
+    job.first(*job.second);
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_.erase(std::find(running_.begin(), running_.end(), job.second));
+  }
+}
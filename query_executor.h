@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <thread>
+#include <vector>
+
+// Cancellation and time budget for one background query. Cancelling
+// interrupts whatever statement the query is running right now.
+class QueryToken
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  QueryToken() = default;
+  explicit QueryToken(Clock::duration budget) : deadline_(Clock::now() + budget) {}
+
+  void cancel();
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+  bool over_budget() const { return deadline_ != Clock::time_point{} && Clock::now() > deadline_; }
+  bool stopped() const { return cancelled() || over_budget(); }
+
+  // Database brackets each statement run for this token with these so
+  // cancel() knows which connection to sqlite3_interrupt.
+  void attach(sqlite3 *db);
+  void detach();
+
+private:
+  std::atomic<bool> cancelled_ = false;
+  Clock::time_point deadline_{};
+  std::mutex mutex_;
+  sqlite3 *db_ = nullptr;
+};
+
+// Worker threads for database queries, so the render thread never waits on
+// SQLite. Results are handed back by posting completions, which run on the UI
+// thread from poll() and can swap state in without locking.
+class QueryExecutor
+{
+public:
+  explicit QueryExecutor(size_t threads = 2);
+  ~QueryExecutor();
+
+  using Job = std::function<void(QueryToken &token)>;
+  // Jobs whose token is cancelled before they start are dropped.
+  std::shared_ptr<QueryToken> submit(Job job, std::shared_ptr<QueryToken> token = nullptr);
+  void post(std::function<void()> completion);
+  // Runs the completions posted so far; call once per frame on the UI thread.
+  void poll();
+
+private:
+  void worker();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<Job, std::shared_ptr<QueryToken>>> jobs_;
+  std::vector<std::shared_ptr<QueryToken>> running_;
+  std::vector<std::function<void()>> completions_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
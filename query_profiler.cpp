@@ -0,0 +1,169 @@
+#include "query_profiler.h"
+#include "read_pool.h"
+#include <chrono>
+#include <log/log.hpp>
+#include <map>
+
+struct QueryProfiler::Trace
+{
+  struct Running
+  {
+    long long prepare_ns = 0;
+    long long rows = 0;
+    std::chrono::steady_clock::time_point start{};
+  };
+
+  QueryProfiler *profiler;
+  std::unordered_map<sqlite3_stmt *, Running> running;
+  // Slow statements waiting for the connection to go idle so their plan can
+  // be taken; the trace callback itself runs inside sqlite3_reset.
+  std::vector<std::pair<QueryStats, std::string>> pending;
+  bool explaining = false;
+};
+
+QueryProfiler::QueryProfiler(double slow_ms, size_t history) : slow_ms_(slow_ms), history_(history)
+{
+}
+
+QueryProfiler::~QueryProfiler() = default;
+
+void QueryProfiler::attach(Connection &conn)
+{
+  auto trace = std::make_unique<Trace>();
+  trace->profiler = this;
+  auto t = trace.get();
+  sqlite3_trace_v2(
+    conn.db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE, &trace_cb, t);
+  conn.stmts.on_prepare = [t](sqlite3_stmt *stmt, long long ns) { t->running[stmt].prepare_ns = ns; };
+  conn.on_idle = [this, t](Connection &c) { flush(*t, c.db); };
+  std::lock_guard<std::mutex> lock(mutex_);
+  traces_.push_back(std::move(trace));
+}
+
+int QueryProfiler::trace_cb(unsigned type, void *ctx, void *p, void *x)
+{
+  auto &trace = *static_cast<Trace *>(ctx);
+  if (trace.explaining)
+    return 0;
+  auto stmt = static_cast<sqlite3_stmt *>(p);
+  if (type == SQLITE_TRACE_STMT)
+  {
+    // Also fires at the start of each trigger program, keep the first start.
+    auto &running = trace.running[stmt];
+    if (running.start == std::chrono::steady_clock::time_point{})
+      running.start = std::chrono::steady_clock::now();
+    return 0;
+  }
+  if (type == SQLITE_TRACE_ROW)
+  {
+    ++trace.running[stmt].rows;
+    return 0;
+  }
+
+  // SQLITE_TRACE_PROFILE reports its own time, but at the VFS clock's
+  // millisecond resolution, which rounds most UI queries down to zero.
+  QueryStats stats;
+  stats.run_ms = *static_cast<sqlite3_int64 *>(x) / 1e6;
+  auto it = trace.running.find(stmt);
+  if (it != trace.running.end())
+  {
+    stats.prepare_ms = it->second.prepare_ns / 1e6;
+    stats.rows = it->second.rows;
+    if (it->second.start != std::chrono::steady_clock::time_point{})
+      stats.run_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                               it->second.start)
+                       .count();
+    trace.running.erase(it);
+  }
+  stats.vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+  stats.fullscan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  stats.sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+  stats.autoindexes = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+  trace.profiler->record(stats);
+  if (stats.prepare_ms + stats.run_ms < trace.profiler->slow_ms())
+    return 0;
+
+  char *expanded = sqlite3_expanded_sql(stmt);
+  stats.sql = expanded ? expanded : sqlite3_sql(stmt);
+  sqlite3_free(expanded);
+  trace.pending.emplace_back(std::move(stats), sqlite3_sql(stmt));
+  return 0;
+}
+
+void QueryProfiler::record(const QueryStats &stats)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++queries_;
+  total_ms_ += stats.prepare_ms + stats.run_ms;
+}
+
+static std::string query_plan(sqlite3 *db, const std::string &sql)
+{
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + sql).c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+  {
+    sqlite3_finalize(stmt);
+    return "(no plan: " + std::string{sqlite3_errmsg(db)} + ")";
+  }
+  std::string plan;
+  std::map<int, int> depth;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int id = sqlite3_column_int(stmt, 0);
+    const int parent = sqlite3_column_int(stmt, 1);
+    const int d = depth[id] = parent ? depth[parent] + 1 : 0;
+    auto detail = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
+    plan += std::string(2 * d, ' ') + (detail ? detail : "") + "\n";
+  }
+  sqlite3_finalize(stmt);
+  return plan;
+}
+
+void QueryProfiler::flush(Trace &trace, sqlite3 *db)
+{
+  // Anything still here belongs to statements that were never run to the end.
+  trace.running.clear();
+  if (trace.pending.empty())
+    return;
+  trace.explaining = true;
+  for (auto &[stats, sql] : trace.pending)
+  {
+    stats.plan = query_plan(db, sql);
+    LOG("Slow query:",
+        stats.prepare_ms + stats.run_ms,
+        "ms,",
+        stats.rows,
+        "rows,",
+        stats.vm_steps,
+        "VM steps,",
+        stats.fullscan_steps,
+        "full scan steps:",
+        stats.sql,
+        "\n",
+        stats.plan);
+    std::lock_guard<std::mutex> lock(mutex_);
+    slow_.push_front(std::move(stats));
+    if (slow_.size() > history_)
+      slow_.pop_back();
+  }
+  trace.pending.clear();
+  trace.explaining = false;
+}
+
+std::vector<QueryStats> QueryProfiler::slow_queries() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return {slow_.begin(), slow_.end()};
+}
+
+size_t QueryProfiler::queries() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queries_;
+}
+
+double QueryProfiler::total_ms() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_ms_;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Connection;
+
+struct QueryStats
+{
+  std::string sql;       // with bound parameters expanded
+  double prepare_ms = 0; // 0 when the statement came from the cache
+  double run_ms = 0;
+  long long rows = 0;
+  int vm_steps = 0;
+  int fullscan_steps = 0;
+  int sorts = 0;
+  int autoindexes = 0;
+  std::string plan; // EXPLAIN QUERY PLAN, only captured for slow queries
+};
+
+// Times every statement run on the attached connections through
+// sqlite3_trace_v2 and sqlite3_stmt_status. Statements slower than the
+// threshold are logged with their query plan and kept in a short history.
+class QueryProfiler
+{
+public:
+  QueryProfiler(double slow_ms, size_t history);
+  ~QueryProfiler();
+
+  void attach(Connection &conn);
+  void set_slow_ms(double ms) { slow_ms_.store(ms, std::memory_order_relaxed); }
+  double slow_ms() const { return slow_ms_.load(std::memory_order_relaxed); }
+  std::vector<QueryStats> slow_queries() const; // newest first
+  size_t queries() const;
+  double total_ms() const;
+
+private:
+  struct Trace;
+  static int trace_cb(unsigned type, void *ctx, void *p, void *x);
+  void record(const QueryStats &stats);
+  void flush(Trace &trace, sqlite3 *db);
+
+  std::atomic<double> slow_ms_;
+  size_t history_;
+  std::vector<std::unique_ptr<Trace>> traces_;
+  mutable std::mutex mutex_;
+  std::deque<QueryStats> slow_;
+  size_t queries_ = 0;
+  double total_ms_ = 0;
+};
@@ -0,0 +1,68 @@
+#include "read_pool.h"
+#include <utility>
+
+Connection::Connection(sqlite3 *db, size_t stmt_cache_capacity)
+  : db(db), stmts(db, stmt_cache_capacity)
+{
+}
+
+Connection::~Connection()
+{
+  stmts.clear();
+  sqlite3_close(db);
+}
+
+ReadPool::Lease::Lease(Lease &&other) noexcept
+  : pool_(std::exchange(other.pool_, nullptr)), conn_(std::exchange(other.conn_, nullptr))
+{
+}
+
+ReadPool::Lease::~Lease()
+{
+  if (pool_)
+    pool_->release(conn_);
+}
+
+void ReadPool::add(std::unique_ptr<Connection> conn)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_.push_back(conn.get());
+  connections_.push_back(std::move(conn));
+  cv_.notify_one();
+}
+
+ReadPool::Lease ReadPool::acquire()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !idle_.empty(); });
+  auto conn = idle_.back();
+  idle_.pop_back();
+  return Lease{this, conn};
+}
+
+void ReadPool::release(Connection *conn)
+{
+  if (conn->on_idle)
+    conn->on_idle(*conn);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(conn);
+  }
+  cv_.notify_one();
+}
+
+size_t ReadPool::hits() const
+{
+  size_t ret = 0;
+  for (const auto &conn : connections_)
+    ret += conn->stmts.hits();
+  return ret;
+}
+
+size_t ReadPool::misses() const
+{
+  size_t ret = 0;
+  for (const auto &conn : connections_)
+    ret += conn->stmts.misses();
+  return ret;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "stmt_cache.h"
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <vector>
+
+// One SQLite connection together with its statement cache. Owns the handle.
+struct Connection
+{
+  explicit Connection(sqlite3 *db, size_t stmt_cache_capacity = 64);
+  ~Connection();
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  sqlite3 *db;
+  StmtCache stmts;
+  // Runs whenever the holder is done with the connection and no statement of
+  // it is in flight, for housekeeping that must not happen mid-query.
+  std::function<void(Connection &)> on_idle;
+};
+
+// Fixed set of read-only connections handed out one caller at a time. With
+// the database in WAL mode each reader sees its own snapshot, so UI queries,
+// background reads and the writer proceed without blocking each other.
+class ReadPool
+{
+public:
+  class Lease
+  {
+  public:
+    Lease(Lease &&other) noexcept;
+    Lease &operator=(Lease &&) = delete;
+    ~Lease();
+
+    Connection &operator*() const { return *conn_; }
+    Connection *operator->() const { return conn_; }
+
+  private:
+    friend class ReadPool;
+    Lease(ReadPool *pool, Connection *conn) : pool_(pool), conn_(conn) {}
+
+    ReadPool *pool_;
+    Connection *conn_;
+  };
+
+  void add(std::unique_ptr<Connection> conn);
+  // Blocks until a connection is free.
+  Lease acquire();
+  size_t size() const { return connections_.size(); }
+  size_t hits() const;
+  size_t misses() const;
+
+private:
+  void release(Connection *conn);
+
+  std::vector<std::unique_ptr<Connection>> connections_;
+  std::vector<Connection *> idle_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
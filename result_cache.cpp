@@ -0,0 +1,26 @@
+#include "result_cache.h"
+#include <algorithm>
+
+ResultCache::Entry *ResultCache::find(const std::string &key)
+{
+  auto it = std::find_if(
+    entries_.begin(), entries_.end(), [&](const auto &entry) { return entry.first == key; });
+  if (it == entries_.end())
+    return nullptr;
+  entries_.splice(entries_.begin(), entries_, it);
+  return &entries_.front().second;
+}
+
+ResultCache::Entry &ResultCache::put(const std::string &key, Entry entry)
+{
+  erase(key);
+  entries_.emplace_front(key, std::move(entry));
+  if (entries_.size() > capacity)
+    entries_.pop_back();
+  return entries_.front().second;
+}
+
+void ResultCache::erase(const std::string &key)
+{
+  entries_.remove_if([&](const auto &entry) { return entry.first == key; });
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "facets.h"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class ResultSet;
+
+// The result lists of the filters shown last, keyed by the normalized filter,
+// so going back to one skips the count and first page queries. Display order
+// is fixed, so the filter is the whole key. An entry remembers the database
+// generation it is current at. A stale one is still handed out and brought up
+// to date from the change log like the list on screen, which touches only the
+// rows that changed; it is dropped when the log no longer reaches back to it.
+// Lives on the UI thread.
+class ResultCache
+{
+public:
+  static constexpr size_t capacity = 8;
+
+  struct Entry
+  {
+    std::shared_ptr<ResultSet> samples;
+    unsigned long long generation = 0;          // database generation the rows are current at
+    unsigned long long attached_generation = 0; // see Database::attached_generation()
+    std::vector<Facet> facets;
+    unsigned long long facets_generation = 0; // 0 if the facets were never counted
+  };
+
+  // Marks the entry as the most recently used one; null if there is none.
+  Entry *find(const std::string &key);
+  // Adds or replaces the entry, dropping the least recently used beyond capacity.
+  Entry &put(const std::string &key, Entry entry);
+  void erase(const std::string &key);
+  size_t size() const { return entries_.size(); }
+
+private:
+  std::list<std::pair<std::string, Entry>> entries_; // most recently used first
+};
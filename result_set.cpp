@@ -0,0 +1,392 @@
+#include "result_set.h"
+#include "database.h"
+#include "natural_sort.h"
+#include "query_executor.h"
+#include <algorithm>
+#include <string_view>
+
+// Display order, the same as ORDER BY dir_key, name_key, ID: naturally by
+// directory first, then by file name.
+static int compare_paths(std::string_view a, std::string_view b)
+{
+  const auto a_sep = a.rfind('/') + 1;
+  const auto b_sep = b.rfind('/') + 1;
+  const auto a_dir = a.substr(0, a_sep);
+  const auto b_dir = b.substr(0, b_sep);
+  if (int cmp = natural_compare(a_dir, b_dir))
+    return cmp;
+  // Directories with the same key are told apart by the raw path.
+  if (int cmp = a_dir.compare(b_dir))
+    return cmp;
+  return natural_compare(a.substr(a_sep), b.substr(b_sep));
+}
+
+static bool key_less(const std::string &filepath, long long id, const Sample &row)
+{
+  const int cmp = compare_paths(filepath, row.filepath);
+  return cmp < 0 || (cmp == 0 && id < row.id);
+}
+
+static bool key_less(const Sample &row, const std::string &filepath, long long id)
+{
+  const int cmp = compare_paths(row.filepath, filepath);
+  return cmp < 0 || (cmp == 0 && row.id < id);
+}
+
+ResultSet::ResultSet(Database &db,
+                     QueryExecutor &executor,
+                     SqlFilter filter,
+                     size_t size,
+                     long long seq)
+  : db_(db),
+    executor_(executor),
+    filter_(std::make_shared<const SqlFilter>(std::move(filter))),
+    size_(size),
+    seq_(seq)
+{
+}
+
+std::shared_ptr<ResultSet> ResultSet::query(Database &db,
+                                            QueryExecutor &executor,
+                                            SqlFilter filter,
+                                            QueryToken &token)
+{
+  long long seq = 0;
+  const auto size = db.count_samples(filter, &token, &seq);
+  if (token.stopped())
+    return nullptr;
+  auto ret = std::make_shared<ResultSet>(db, executor, std::move(filter), size, seq);
+  if (size > 0)
+  {
+    // The page may be newer than the count; apply() replaces rows it finds
+    // resident, so replaying those changes later is harmless.
+    std::vector<Sample> rows;
+    db.load_sample_page(rows, *ret->filter_, nullptr, 0, page_size, &token);
+    if (token.stopped())
+      return nullptr;
+    ret->requested_.insert(0);
+    ret->on_page(0, ret->generation_, std::move(rows));
+  }
+  return ret;
+}
+
+void ResultSet::request(size_t page_idx)
+{
+  if (!requested_.insert(page_idx).second)
+    return;
+
+  // Seek from the closest known key before the page. Scrolling walks page by
+  // page so that is normally the row right before it; a jump pays an OFFSET
+  // over the rows in between, once, and leaves an anchor behind.
+  const size_t first = page_idx * page_size;
+  std::optional<Sample> after;
+  size_t from = 0;
+  if (const Sample *prev = first > 0 ? row(first - 1) : nullptr)
+  {
+    after = *prev;
+    from = first;
+  }
+  else if (auto anchor = anchors_.upper_bound(first); anchor != anchors_.begin())
+  {
+    --anchor;
+    after = anchor->second;
+    from = anchor->first;
+  }
+  executor_.submit([self = weak_from_this(),
+                    &db = db_,
+                    &executor = executor_,
+                    filter = filter_,
+                    after = std::move(after),
+                    offset = first - from,
+                    page_idx,
+                    generation = generation_](QueryToken &token) {
+    std::vector<Sample> rows;
+    db.load_sample_page(rows, *filter, after ? &*after : nullptr, offset, page_size, &token);
+    executor.post([self, page_idx, generation, rows = std::move(rows)]() mutable {
+      if (auto rs = self.lock())
+        rs->on_page(page_idx, generation, std::move(rows));
+    });
+  });
+}
+
+void ResultSet::on_page(size_t page_idx, unsigned generation, std::vector<Sample> rows)
+{
+  if (generation != generation_)
+    return;
+  requested_.erase(page_idx);
+  const size_t first = page_idx * page_size;
+  const size_t last = first + rows.size();
+  if (!rows.empty() && last < size_)
+    anchors_[last] = rows.back();
+  if (rows.empty())
+    return;
+
+  // The page replaces whatever resident rows it overlaps.
+  std::vector<std::pair<size_t, std::vector<Sample>>> kept;
+  auto it = runs_.upper_bound(first);
+  if (it != runs_.begin())
+    --it;
+  while (it != runs_.end() && it->first < last)
+  {
+    const size_t start = it->first;
+    auto &run = it->second;
+    const size_t end = start + run.size();
+    if (end > first)
+    {
+      if (end > last)
+        kept.emplace_back(last, std::vector<Sample>(run.end() - (end - last), run.end()));
+      if (start < first)
+        run.resize(first - start);
+      else
+      {
+        it = runs_.erase(it);
+        continue;
+      }
+    }
+    ++it;
+  }
+  for (auto &run : kept)
+    runs_.insert(std::move(run));
+  runs_[first] = std::move(rows);
+}
+
+bool ResultSet::covered(size_t first, size_t last) const
+{
+  while (first < last)
+  {
+    auto it = runs_.upper_bound(first);
+    if (it == runs_.begin())
+      return false;
+    --it;
+    const size_t end = it->first + it->second.size();
+    if (end <= first)
+      return false;
+    first = end;
+  }
+  return true;
+}
+
+void ResultSet::fetch(size_t first, size_t last)
+{
+  last = std::min(last, size_);
+  if (first >= last)
+    return;
+  auto want = [this](size_t p) {
+    if (!covered(p * page_size, std::min((p + 1) * page_size, size_)))
+      request(p);
+  };
+  const size_t first_page = first / page_size;
+  const size_t last_page = (last - 1) / page_size;
+  for (size_t p = first_page; p <= last_page; ++p)
+    want(p);
+
+  const bool scrolling_down = first >= last_first_;
+  last_first_ = first;
+  if (scrolling_down && (last_page + 1) * page_size < size_)
+    want(last_page + 1);
+  else if (!scrolling_down && first_page > 0)
+    want(first_page - 1);
+
+  const size_t keep_first = (first_page > keep_pages ? first_page - keep_pages : 0) * page_size;
+  const size_t keep_last = (last_page + keep_pages + 1) * page_size;
+  for (auto it = runs_.begin(); it != runs_.end();)
+  {
+    if (it->first + it->second.size() <= keep_first || it->first >= keep_last)
+      it = runs_.erase(it);
+    else
+      ++it;
+  }
+}
+
+const Sample *ResultSet::row(size_t idx) const
+{
+  auto it = runs_.upper_bound(idx);
+  if (it == runs_.begin())
+    return nullptr;
+  --it;
+  const auto offset = idx - it->first;
+  return offset < it->second.size() ? &it->second[offset] : nullptr;
+}
+
+std::optional<size_t> ResultSet::index_of(long long id) const
+{
+  for (const auto &[start, run] : runs_)
+    for (size_t i = 0; i < run.size(); ++i)
+      if (run[i].id == id)
+        return start + i;
+  return std::nullopt;
+}
+
+size_t ResultSet::resident_rows() const
+{
+  size_t ret = 0;
+  for (const auto &[start, run] : runs_)
+    ret += run.size();
+  return ret;
+}
+
+void ResultSet::apply(const SampleChanges &changes)
+{
+  seq_ = changes.seq;
+  if (changes.changes.empty())
+    return;
+  // Pages in flight were positioned before these changes.
+  ++generation_;
+  requested_.clear();
+
+  // Past a page of changes, refetching the view is cheaper than placing them.
+  if (changes.changes.size() > page_size)
+  {
+    runs_.clear();
+    anchors_.clear();
+  }
+  else
+  {
+    for (const auto &change : changes.changes)
+    {
+      auto run = runs_.begin();
+      size_t offset = 0;
+      for (; run != runs_.end(); ++run)
+      {
+        auto row = std::find_if(run->second.begin(), run->second.end(), [&](const Sample &s) {
+          return s.id == change.id;
+        });
+        if (row != run->second.end())
+        {
+          offset = row - run->second.begin();
+          break;
+        }
+      }
+
+      if (run != runs_.end())
+      {
+        const Sample key = run->second[offset];
+        run->second.erase(run->second.begin() + offset);
+        auto next = std::next(run);
+        if (run->second.empty())
+          runs_.erase(run);
+        shift(next, key.filepath, key.id, -1);
+        --size_;
+      }
+      else if (change.old_filepath)
+      {
+        // Not resident. Between two rows of a run it was not a match either.
+        // Anywhere else it was one for sure only without a filter; otherwise
+        // the rows after it can no longer be placed.
+        const auto &filepath = *change.old_filepath;
+        const bool inside = std::any_of(runs_.begin(), runs_.end(), [&](const auto &r) {
+          return !key_less(filepath, change.id, r.second.front()) &&
+                 !key_less(r.second.back(), filepath, change.id);
+        });
+        if (!inside && filter_->where.empty())
+        {
+          auto next = std::find_if(runs_.begin(), runs_.end(), [&](const auto &r) {
+            return key_less(filepath, change.id, r.second.front());
+          });
+          shift(next, filepath, change.id, -1);
+          --size_;
+        }
+        else if (!inside)
+          drop_after(filepath, change.id);
+      }
+
+      if (change.row)
+      {
+        insert(*change.row);
+        ++size_;
+      }
+    }
+  }
+
+  size_ = changes.size;
+  while (!runs_.empty() && runs_.rbegin()->first >= size_)
+    runs_.erase(std::prev(runs_.end()));
+  if (!runs_.empty())
+  {
+    auto &last = *runs_.rbegin();
+    if (last.first + last.second.size() > size_)
+      last.second.resize(size_ - last.first);
+  }
+}
+
+void ResultSet::insert(const Sample &row)
+{
+  auto next = std::find_if(runs_.begin(), runs_.end(), [&](const auto &r) {
+    return key_less(row.filepath, row.id, r.second.front());
+  });
+  auto prev = next == runs_.begin() ? runs_.end() : std::prev(next);
+
+  if (prev != runs_.end())
+  {
+    auto &rows = prev->second;
+    const size_t prev_end = prev->first + rows.size();
+    const bool inside = key_less(row.filepath, row.id, rows.back());
+    // Right after the run only if nothing unloaded sits between them.
+    const bool adjacent = next != runs_.end() ? prev_end == next->first : prev_end == size_;
+    if (inside || adjacent)
+    {
+      auto pos = std::lower_bound(rows.begin(), rows.end(), row, [](const Sample &a, const Sample &b) {
+        return key_less(a, b.filepath, b.id);
+      });
+      rows.insert(pos, row);
+      shift(next, row.filepath, row.id, 1);
+      return;
+    }
+  }
+  else if (next != runs_.end() && next->first == 0)
+  {
+    // Ahead of everything, so it becomes row 0 of the first run.
+    next->second.insert(next->second.begin(), row);
+    shift(std::next(next), row.filepath, row.id, 1);
+    return;
+  }
+  // Lands in rows that are not resident; only what follows moves.
+  shift(next, row.filepath, row.id, 1);
+}
+
+void ResultSet::shift(Runs::iterator from,
+                      const std::string &filepath,
+                      long long id,
+                      int delta)
+{
+  std::vector<Runs::node_type> runs;
+  while (from != runs_.end())
+    runs.push_back(runs_.extract(from++));
+  for (auto &run : runs)
+  {
+    run.key() += delta;
+    runs_.insert(std::move(run));
+  }
+
+  std::vector<decltype(anchors_)::node_type> anchors;
+  for (auto it = anchors_.begin(); it != anchors_.end();)
+  {
+    if (!key_less(it->second, filepath, id))
+      anchors.push_back(anchors_.extract(it++));
+    else
+      ++it;
+  }
+  for (auto &anchor : anchors)
+  {
+    anchor.key() += delta;
+    anchors_.insert(std::move(anchor));
+  }
+}
+
+void ResultSet::drop_after(const std::string &filepath, long long id)
+{
+  for (auto it = runs_.begin(); it != runs_.end();)
+  {
+    if (key_less(filepath, id, it->second.front()))
+      it = runs_.erase(it);
+    else
+      ++it;
+  }
+  for (auto it = anchors_.begin(); it != anchors_.end();)
+  {
+    if (!key_less(it->second, filepath, id))
+      it = anchors_.erase(it);
+    else
+      ++it;
+  }
+}
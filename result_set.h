@@ -0,0 +1,82 @@
+#pragma once
+
+#include "filter.h"
+#include "sample.h"
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+class Database;
+class QueryExecutor;
+class QueryToken;
+struct SampleChanges;
+
+// Rows matching a filter, in display order, without materializing them. Only
+// the total count is read up front; rows are fetched in fixed-size pages by
+// keyset around the visible range, the page ahead of the scroll direction is
+// prefetched and rows far from the view are dropped. Pages are loaded on the
+// executor and land through its completions, so apart from query() all of it
+// lives on the UI thread.
+class ResultSet : public std::enable_shared_from_this<ResultSet>
+{
+public:
+  static constexpr size_t page_size = 256;
+  static constexpr size_t keep_pages = 4; // resident pages kept on each side of the view
+
+  ResultSet(Database &db,
+            QueryExecutor &executor,
+            SqlFilter filter = {},
+            size_t size = 0,
+            long long seq = 0);
+  // Counts the matches and loads the first page, for running on an executor
+  // worker. Returns null if the token stopped it.
+  static std::shared_ptr<ResultSet> query(Database &db,
+                                          QueryExecutor &executor,
+                                          SqlFilter filter,
+                                          QueryToken &token);
+
+  size_t size() const { return size_; }
+  const SqlFilter &filter() const { return *filter_; }
+  // Change-log position the rows are as of.
+  long long seq() const { return seq_; }
+  // Requests the pages rows [first, last) are on, prefetches ahead and evicts the rest.
+  void fetch(size_t first, size_t last);
+  // nullptr until the row's page has arrived.
+  const Sample *row(size_t idx) const;
+  std::optional<size_t> index_of(long long id) const;
+  size_t resident_rows() const;
+  // Brings the rows up to changes.seq in place: resident rows are replaced,
+  // removed or inserted at their sort position and everything after moves
+  // along. Only a row that left from outside the resident rows cannot be
+  // placed; what follows it is dropped and refetched. `changes` must be complete.
+  void apply(const SampleChanges &changes);
+
+private:
+  using Runs = std::map<size_t, std::vector<Sample>>;
+
+  void request(size_t page_idx);
+  void on_page(size_t page_idx, unsigned generation, std::vector<Sample> rows);
+  bool covered(size_t first, size_t last) const;
+  void insert(const Sample &row);
+  // Moves the runs from `from` on, and the anchors at or after the key, by `delta` rows.
+  void shift(Runs::iterator from, const std::string &filepath, long long id, int delta);
+  // Forgets the rows and anchors after the key, whose positions are unknown.
+  void drop_after(const std::string &filepath, long long id);
+
+  Database &db_;
+  QueryExecutor &executor_;
+  std::shared_ptr<const SqlFilter> filter_;
+  size_t size_;
+  long long seq_;
+  // Resident runs of rows keyed by the index of their first row. They start
+  // out as pages but grow and shrink as changes are applied.
+  Runs runs_;
+  std::unordered_set<size_t> requested_;
+  unsigned generation_ = 0; // pages requested before the last apply() are stale
+  // Index N keyed to the row at N - 1: the keyset position row N starts after.
+  std::map<size_t, Sample> anchors_;
+  size_t last_first_ = 0;
+};
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <ser/macro.hpp>
 #include <string>
+#include <string_view>
 
 struct Sample
 {
+  long long id = 0;
   std::string filepath;
   long long size;
   double duration;
@@ -11,4 +14,44 @@ struct Sample
   int bit_depth;
   int channels;
   std::string tags;
+  SER_PROPS(id, filepath, size, duration, sample_rate, bit_depth, channels, tags);
+};
+
+// A sample whose text lives elsewhere, in a statement's row or a snapshot's
+// arena, and is good only as long as that is.
+struct SampleRef
+{
+  long long id = 0;
+  std::string_view filepath;
+  long long size = 0;
+  double duration = 0;
+  int sample_rate = 0;
+  int bit_depth = 0;
+  int channels = 0;
+  std::string_view tags;
+  SER_PROPS(id, filepath, size, duration, sample_rate, bit_depth, channels, tags);
+
+  SampleRef() = default;
+  SampleRef(const Sample &s)
+    : id(s.id),
+      filepath(s.filepath),
+      size(s.size),
+      duration(s.duration),
+      sample_rate(s.sample_rate),
+      bit_depth(s.bit_depth),
+      channels(s.channels),
+      tags(s.tags)
+  {
+  }
+  Sample sample() const
+  {
+    return {id,
+            std::string{filepath},
+            size,
+            duration,
+            sample_rate,
+            bit_depth,
+            channels,
+            std::string{tags}};
+  }
 };
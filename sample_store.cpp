@@ -0,0 +1,678 @@
+#include "sample_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <optional>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using Column = SampleSnapshot::Column;
+
+// Calls `f` with the array of a numeric column.
+template <typename F>
+static void with_numbers(const SampleSnapshot::Columns &columns, int column, F f)
+{
+  switch (column)
+  {
+  case Column::Id:
+    return f(columns.id);
+  case Column::Size:
+    return f(columns.size);
+  case Column::Duration:
+    return f(columns.duration);
+  case Column::SampleRate:
+    return f(columns.sample_rate);
+  case Column::BitDepth:
+    return f(columns.bit_depth);
+  case Column::Channels:
+    return f(columns.channels);
+  }
+}
+
+void SampleSnapshot::Strings::push_back(std::string_view text)
+{
+  auto &bytes = arena.owned();
+  if (offsets.empty())
+    offsets.owned().push_back(0);
+  bytes.insert(bytes.end(), text.begin(), text.end());
+  offsets.owned().push_back(bytes.size());
+}
+
+// Drops what an array grew beyond its size, if that is a lot.
+template <typename T>
+static void trim(PodArray<T> &a)
+{
+  auto &v = a.owned();
+  if (v.capacity() - v.size() > v.size() / 8)
+    v.shrink_to_fit();
+}
+
+void SampleSnapshot::Builder::reserve(size_t rows, size_t filepath_bytes, size_t tags_bytes)
+{
+  auto &c = columns_;
+  c.id.owned().reserve(rows);
+  filepaths_.arena.owned().reserve(filepath_bytes);
+  filepaths_.offsets.owned().reserve(rows + 1);
+  c.size.owned().reserve(rows);
+  c.duration.owned().reserve(rows);
+  c.sample_rate.owned().reserve(rows);
+  c.bit_depth.owned().reserve(rows);
+  c.channels.owned().reserve(rows);
+  c.tags.arena.owned().reserve(tags_bytes);
+  c.tags.offsets.owned().reserve(rows + 1);
+}
+
+void SampleSnapshot::Builder::add(const SampleRef &row)
+{
+  auto &c = columns_;
+  c.id.owned().push_back(row.id);
+  filepaths_.push_back(row.filepath);
+  c.size.owned().push_back(row.size);
+  c.duration.owned().push_back(row.duration);
+  c.sample_rate.owned().push_back(row.sample_rate);
+  c.bit_depth.owned().push_back(row.bit_depth);
+  c.channels.owned().push_back(row.channels);
+  c.tags.push_back(row.tags);
+}
+
+SampleSnapshot::SampleSnapshot(Builder rows, long long seq)
+  : columns_(std::move(rows.columns_)), seq_(seq)
+{
+  // Rows collected without a reserve() may have grown well past their size.
+  auto &c = columns_;
+  trim(c.id);
+  trim(c.size);
+  trim(c.duration);
+  trim(c.sample_rate);
+  trim(c.bit_depth);
+  trim(c.channels);
+  trim(c.tags.arena);
+  trim(c.tags.offsets);
+  if (c.tags.offsets.empty())
+    c.tags.offsets.owned().push_back(0);
+  for (int column = Filepath; column < Tags; ++column)
+  {
+    auto &order = orders_[column].owned();
+    order.resize(size());
+    std::iota(order.begin(), order.end(), 0);
+    // Stable, so equal values stay in ID order.
+    if (column == Filepath)
+    {
+      const auto &paths = rows.filepaths_;
+      std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return paths[a] < paths[b];
+      });
+      c.filepath =
+        FrontCodedStrings(order.size(), [&](size_t rank) { return paths[order[rank]]; });
+      auto &ranks = c.filepath_rank.owned();
+      ranks.resize(order.size());
+      for (size_t rank = 0; rank < order.size(); ++rank)
+        ranks[order[rank]] = static_cast<uint32_t>(rank);
+      rows.filepaths_ = {};
+    }
+    else
+      with_numbers(c, column, [&](const auto &values) {
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+          return values[a] < values[b];
+        });
+      });
+  }
+}
+
+SampleRef SampleSnapshot::row(size_t idx, FrontCodedStrings::Reader &paths) const
+{
+  const auto &c = columns_;
+  SampleRef ret;
+  ret.id = c.id[idx];
+  ret.filepath = paths[c.filepath_rank[idx]];
+  ret.size = c.size[idx];
+  ret.duration = c.duration[idx];
+  ret.sample_rate = c.sample_rate[idx];
+  ret.bit_depth = c.bit_depth[idx];
+  ret.channels = c.channels[idx];
+  ret.tags = c.tags[idx];
+  return ret;
+}
+
+// Snapshot files hold a FileHeader and then the arrays, each at an offset
+// aligned for any element type, in native byte order and layout: a file from
+// a build that differs fails the checks in map() and is simply not used.
+namespace
+{
+constexpr char file_magic[8] = {'s', 'f', 'x', 's', 't', 'o', 'r', 'e'};
+constexpr uint32_t file_version = 2;
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr size_t file_arrays = 17; // see SampleSnapshot::arrays()
+constexpr size_t file_alignment = 8;
+
+struct FileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  int64_t seq;
+  int64_t library_id;
+  uint64_t rows;
+  uint64_t paths_text_size;
+  struct
+  {
+    uint64_t offset;
+    uint64_t count;
+  } arrays[file_arrays];
+};
+
+struct FileWriter
+{
+  std::ofstream &out;
+  FileHeader &header;
+  size_t next = 0;
+
+  template <typename T>
+  void operator()(const PodArray<T> &a)
+  {
+    static const char zeros[file_alignment] = {};
+    const auto pos = static_cast<uint64_t>(out.tellp());
+    out.write(zeros, (file_alignment - pos % file_alignment) % file_alignment);
+    header.arrays[next].offset = static_cast<uint64_t>(out.tellp());
+    header.arrays[next++].count = a.size();
+    out.write(reinterpret_cast<const char *>(a.data()), a.size() * sizeof(T));
+  }
+  void operator()(const FrontCodedStrings &s)
+  {
+    (*this)(s.data());
+    (*this)(s.blocks());
+  }
+};
+
+struct FileMapper
+{
+  const char *base;
+  size_t size;
+  const FileHeader &header;
+  size_t next = 0;
+  bool ok = true;
+
+  template <typename T>
+  void operator()(PodArray<T> &a)
+  {
+    const auto &entry = header.arrays[next++];
+    ok = ok && entry.offset % file_alignment == 0 && entry.offset <= size &&
+         entry.count <= (size - entry.offset) / sizeof(T);
+    if (ok)
+      a = PodArray<T>(reinterpret_cast<const T *>(base + entry.offset), entry.count);
+  }
+  void operator()(FrontCodedStrings &s)
+  {
+    PodArray<char> data;
+    PodArray<uint64_t> blocks;
+    (*this)(data);
+    (*this)(blocks);
+    s = FrontCodedStrings(std::move(data), std::move(blocks), header.rows, header.paths_text_size);
+  }
+};
+} // namespace
+
+template <typename Self, typename Io>
+void SampleSnapshot::arrays(Self &self, Io &io)
+{
+  auto &c = self.columns_;
+  io(c.id);
+  io(c.filepath);
+  io(c.filepath_rank);
+  io(c.size);
+  io(c.duration);
+  io(c.sample_rate);
+  io(c.bit_depth);
+  io(c.channels);
+  io(c.tags.arena);
+  io(c.tags.offsets);
+  for (int column = Filepath; column < Tags; ++column)
+    io(self.orders_[column]);
+}
+
+// Has the file, or the entries of the directory, reach the disk.
+static bool sync(const std::filesystem::path &path, int flags = O_RDONLY)
+{
+  const int fd = open(path.c_str(), flags);
+  if (fd < 0)
+    return false;
+  const bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// Whether every element is below `limit`.
+template <typename T>
+static bool all_below(const PodArray<T> &a, size_t limit)
+{
+  return std::all_of(a.begin(), a.end(), [limit](T v) { return v < limit; });
+}
+
+bool SampleSnapshot::save(const std::string &path, long long library_id) const
+{
+  const std::string part = path + ".part";
+  {
+    std::ofstream out(part, std::ios::binary | std::ios::trunc);
+    FileHeader header{};
+    std::memcpy(header.magic, file_magic, sizeof file_magic);
+    header.version = file_version;
+    header.byte_order = byte_order_mark;
+    header.seq = seq_;
+    header.library_id = library_id;
+    header.rows = size();
+    header.paths_text_size = columns_.filepath.text_size();
+    out.write(reinterpret_cast<const char *>(&header), sizeof header);
+    FileWriter writer{out, header};
+    arrays(*this, writer);
+    // The offsets are known now.
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof header);
+    out.close();
+    // On the disk before the rename is, or a crash could leave the new name
+    // on a file whose data never made it.
+    if (!out || !sync(part))
+    {
+      std::error_code ec;
+      std::filesystem::remove(part, ec);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(part, path, ec);
+  if (ec)
+    return false;
+  const auto dir = std::filesystem::path(path).parent_path();
+  return sync(dir.empty() ? "." : dir, O_RDONLY | O_DIRECTORY);
+}
+
+std::shared_ptr<const SampleSnapshot> SampleSnapshot::map(const std::string &path,
+                                                          long long library_id)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(FileHeader))
+    addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return nullptr;
+  const auto size = static_cast<size_t>(st.st_size);
+  std::shared_ptr<const void> mapping(addr, [size](const void *p) {
+    munmap(const_cast<void *>(p), size);
+  });
+
+  const auto &header = *static_cast<const FileHeader *>(addr);
+  if (std::memcmp(header.magic, file_magic, sizeof file_magic) != 0 ||
+      header.version != file_version || header.byte_order != byte_order_mark ||
+      header.library_id != library_id || header.rows > UINT32_MAX)
+    return nullptr;
+  std::shared_ptr<SampleSnapshot> ret(new SampleSnapshot);
+  ret->seq_ = header.seq;
+  FileMapper mapper{static_cast<const char *>(addr), size, header};
+  arrays(*ret, mapper);
+  // The arrays have to agree with each other, and every offset and row index
+  // in them has to stay within bounds, or a damaged file could have queries
+  // read outside the mapping. Values that are merely wrong can't do that.
+  const size_t rows = header.rows;
+  const auto &c = ret->columns_;
+  bool ok = mapper.ok && c.id.size() == rows && c.filepath_rank.size() == rows &&
+            c.size.size() == rows && c.duration.size() == rows && c.sample_rate.size() == rows &&
+            c.bit_depth.size() == rows && c.channels.size() == rows &&
+            c.tags.offsets.size() == rows + 1 && c.tags.offsets[0] == 0 &&
+            c.tags.offsets[rows] == c.tags.arena.size() &&
+            std::is_sorted(c.tags.offsets.begin(), c.tags.offsets.end()) &&
+            all_below(c.filepath_rank, rows) && c.filepath.valid();
+  for (int column = Filepath; column < Tags; ++column)
+    ok = ok && ret->orders_[column].size() == rows && all_below(ret->orders_[column], rows);
+  if (!ok)
+    return nullptr;
+  ret->mapping_ = std::move(mapping);
+  return ret;
+}
+
+void SampleStore::set(std::shared_ptr<const SampleSnapshot> snapshot)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Refreshes running side by side may finish out of order.
+  if (!snapshot_ || snapshot->seq() >= snapshot_->seq())
+    snapshot_ = std::move(snapshot);
+}
+
+std::shared_ptr<const SampleSnapshot> SampleStore::get() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return snapshot_;
+}
+
+namespace
+{
+struct Table : sqlite3_vtab
+{
+  SampleStore *store = nullptr;
+};
+
+// Walks positions [pos, end) of the rows in the order of the column the plan
+// picked, holding on to the snapshot it started on.
+struct Cursor : sqlite3_vtab_cursor
+{
+  std::shared_ptr<const SampleSnapshot> snapshot;
+  const PodArray<uint32_t> *order = nullptr; // null for ID order
+  size_t pos = 0;
+  size_t end = 0;
+  // Decodes the paths, cheaply when the scan goes in path order.
+  std::optional<FrontCodedStrings::Reader> paths;
+
+  // Index of the row at the cursor.
+  size_t row() const { return order ? (*order)[pos] : pos; }
+};
+
+// idx_num: the column the scan goes by, in the low bits, and which of its
+// constraints were passed to filter(), in this order.
+constexpr int column_mask = 0xf;
+constexpr int has_eq = 0x10;
+constexpr int has_lower = 0x20;
+constexpr int has_upper = 0x40;
+constexpr int full_scan = Column::Id;
+} // namespace
+
+static int vtab_connect(sqlite3 *db,
+                        void *aux,
+                        int /*argc*/,
+                        const char *const * /*argv*/,
+                        sqlite3_vtab **vtab,
+                        char ** /*err*/)
+{
+  int rc = sqlite3_declare_vtab(db,
+                                "CREATE TABLE x(ID INTEGER, filepath TEXT, size INTEGER, "
+                                "duration REAL, samplerate INTEGER, bitdepth INTEGER, "
+                                "channels INTEGER, tags TEXT)");
+  if (rc != SQLITE_OK)
+    return rc;
+  sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+  auto *table = new Table{};
+  table->store = static_cast<SampleStore *>(aux);
+  *vtab = table;
+  return SQLITE_OK;
+}
+
+static int vtab_disconnect(sqlite3_vtab *vtab)
+{
+  delete static_cast<Table *>(vtab);
+  return SQLITE_OK;
+}
+
+// Picks the one indexed column whose constraints narrow the rows down the
+// most and hands those to filter(). The constraints are still checked by
+// SQLite: filter() only narrows by the ones it can compare exactly, and a
+// strict bound is taken as an inclusive one.
+static int vtab_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  const auto snapshot = static_cast<Table *>(vtab)->store->get();
+  const double rows = snapshot ? std::max<double>(snapshot->size(), 1) : 1;
+
+  struct Bounds
+  {
+    int eq = -1;
+    int lower = -1;
+    int upper = -1;
+  };
+  Bounds bounds[Column::ColumnCount];
+  for (int i = 0; i < info->nConstraint; ++i)
+  {
+    const auto &constraint = info->aConstraint[i];
+    const int column = constraint.iColumn < 0 ? Column::Id : constraint.iColumn;
+    if (!constraint.usable || column == Column::Tags)
+      continue;
+    // The paths are ordered byte-wise.
+    if (column == Column::Filepath &&
+        sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY") != 0)
+      continue;
+    auto &b = bounds[column];
+    switch (constraint.op)
+    {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      b.eq = b.eq < 0 ? i : b.eq;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      b.lower = b.lower < 0 ? i : b.lower;
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      b.upper = b.upper < 0 ? i : b.upper;
+      break;
+    }
+  }
+
+  int best = full_scan;
+  double best_rows = rows;
+  double best_cost = rows;
+  for (int column = 0; column < Column::Tags; ++column)
+  {
+    const auto &b = bounds[column];
+    double matches;
+    if (b.eq >= 0)
+      matches = column == Column::Id || column == Column::Filepath ? 1 : rows / 10;
+    else if (b.lower >= 0 && b.upper >= 0)
+      matches = rows / 16;
+    else if (b.lower >= 0 || b.upper >= 0)
+      matches = rows / 4;
+    else
+      continue;
+    const double cost = std::log2(rows) + matches;
+    if (cost < best_cost)
+    {
+      best = column;
+      best_rows = matches;
+      best_cost = cost;
+    }
+  }
+
+  int idx_num = best;
+  int argv_idx = 0;
+  const auto &b = bounds[best];
+  if (b.eq >= 0)
+  {
+    info->aConstraintUsage[b.eq].argvIndex = ++argv_idx;
+    idx_num |= has_eq;
+    if (best == Column::Id)
+      info->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+  }
+  else
+  {
+    if (b.lower >= 0)
+    {
+      info->aConstraintUsage[b.lower].argvIndex = ++argv_idx;
+      idx_num |= has_lower;
+    }
+    if (b.upper >= 0)
+    {
+      info->aConstraintUsage[b.upper].argvIndex = ++argv_idx;
+      idx_num |= has_upper;
+    }
+  }
+  info->idxNum = idx_num;
+  info->estimatedRows = static_cast<sqlite3_int64>(best_rows);
+  info->estimatedCost = best_cost;
+
+  // Rows come out in the order of the scanned column. Paths are left to
+  // SQLite, which may sort them under another collation.
+  if (info->nOrderBy == 1 && !info->aOrderBy[0].desc && best != Column::Filepath)
+  {
+    const int column = info->aOrderBy[0].iColumn < 0 ? Column::Id : info->aOrderBy[0].iColumn;
+    info->orderByConsumed = column == best;
+  }
+  return SQLITE_OK;
+}
+
+static int vtab_open(sqlite3_vtab * /*vtab*/, sqlite3_vtab_cursor **cursor)
+{
+  *cursor = new Cursor{};
+  return SQLITE_OK;
+}
+
+static int vtab_close(sqlite3_vtab_cursor *cursor)
+{
+  delete static_cast<Cursor *>(cursor);
+  return SQLITE_OK;
+}
+
+// First position in [first, last) whose row is not before the value.
+template <typename Before>
+static size_t partition(const Cursor &c, size_t first, size_t last, Before before)
+{
+  while (first < last)
+  {
+    const size_t mid = first + (last - first) / 2;
+    if (before(c.order ? (*c.order)[mid] : mid))
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first;
+}
+
+// Narrows the cursor to rows at or after (lower) or at or before (upper) the
+// value, if it can be compared with the column exactly.
+static void narrow(Cursor &c, int column, sqlite3_value *value, bool lower, bool upper)
+{
+  const int type = sqlite3_value_type(value);
+  if (column == Column::Filepath)
+  {
+    if (type != SQLITE_TEXT)
+      return;
+    const std::string_view text{reinterpret_cast<const char *>(sqlite3_value_text(value)),
+                                static_cast<size_t>(sqlite3_value_bytes(value))};
+    const auto &rank = c.snapshot->columns().filepath_rank;
+    auto &paths = *c.paths;
+    if (lower)
+      c.pos = partition(c, c.pos, c.end, [&](size_t row) { return paths[rank[row]] < text; });
+    if (upper)
+      c.end = partition(c, c.pos, c.end, [&](size_t row) { return paths[rank[row]] <= text; });
+    return;
+  }
+  if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+    return;
+  const double v = sqlite3_value_double(value);
+  with_numbers(c.snapshot->columns(), column, [&](const auto &values) {
+    if (lower)
+      c.pos = partition(c, c.pos, c.end, [&](size_t row) { return values[row] < v; });
+    if (upper)
+      c.end = partition(c, c.pos, c.end, [&](size_t row) { return values[row] <= v; });
+  });
+}
+
+static int vtab_filter(sqlite3_vtab_cursor *cursor,
+                       int idx_num,
+                       const char * /*idx_str*/,
+                       int /*argc*/,
+                       sqlite3_value **argv)
+{
+  auto &c = *static_cast<Cursor *>(cursor);
+  c.snapshot = static_cast<Table *>(cursor->pVtab)->store->get();
+  c.pos = 0;
+  c.end = c.snapshot ? c.snapshot->size() : 0;
+  if (!c.snapshot)
+    return SQLITE_OK;
+  c.paths.emplace(c.snapshot->columns().filepath);
+  const int column = idx_num & column_mask;
+  c.order = column == Column::Id ? nullptr : &c.snapshot->order(static_cast<Column>(column));
+  int arg = 0;
+  if (idx_num & has_eq)
+    narrow(c, column, argv[arg++], true, true);
+  if (idx_num & has_lower)
+    narrow(c, column, argv[arg++], true, false);
+  if (idx_num & has_upper)
+    narrow(c, column, argv[arg++], false, true);
+  return SQLITE_OK;
+}
+
+static int vtab_next(sqlite3_vtab_cursor *cursor)
+{
+  ++static_cast<Cursor *>(cursor)->pos;
+  return SQLITE_OK;
+}
+
+static int vtab_eof(sqlite3_vtab_cursor *cursor)
+{
+  const auto &c = *static_cast<Cursor *>(cursor);
+  return c.pos >= c.end;
+}
+
+static int vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column)
+{
+  // The snapshot the cursor holds keeps the tags alive while SQLite uses them.
+  // Paths are decoded into the cursor, so SQLite takes a copy.
+  auto &c = *static_cast<Cursor *>(cursor);
+  const auto &columns = c.snapshot->columns();
+  const size_t row = c.row();
+  switch (column)
+  {
+  case Column::Id:
+    sqlite3_result_int64(context, columns.id[row]);
+    break;
+  case Column::Filepath:
+  {
+    const auto text = (*c.paths)[columns.filepath_rank[row]];
+    sqlite3_result_text(context, text.data(), static_cast<int>(text.size()), SQLITE_TRANSIENT);
+    break;
+  }
+  case Column::Size:
+    sqlite3_result_int64(context, columns.size[row]);
+    break;
+  case Column::Duration:
+    sqlite3_result_double(context, columns.duration[row]);
+    break;
+  case Column::SampleRate:
+    sqlite3_result_int(context, columns.sample_rate[row]);
+    break;
+  case Column::BitDepth:
+    sqlite3_result_int(context, columns.bit_depth[row]);
+    break;
+  case Column::Channels:
+    sqlite3_result_int(context, columns.channels[row]);
+    break;
+  case Column::Tags:
+  {
+    const auto text = columns.tags[row];
+    sqlite3_result_text(context, text.data(), static_cast<int>(text.size()), SQLITE_STATIC);
+    break;
+  }
+  }
+  return SQLITE_OK;
+}
+
+static int vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+  const auto &c = *static_cast<Cursor *>(cursor);
+  *rowid = c.snapshot->columns().id[c.row()];
+  return SQLITE_OK;
+}
+
+void SampleStore::attach(sqlite3 *db)
+{
+  // No xCreate: the table exists under the module's own name only.
+  static sqlite3_module module = [] {
+    sqlite3_module m{};
+    m.xConnect = &vtab_connect;
+    m.xBestIndex = &vtab_best_index;
+    m.xDisconnect = &vtab_disconnect;
+    m.xOpen = &vtab_open;
+    m.xClose = &vtab_close;
+    m.xFilter = &vtab_filter;
+    m.xNext = &vtab_next;
+    m.xEof = &vtab_eof;
+    m.xColumn = &vtab_column;
+    m.xRowid = &vtab_rowid;
+    return m;
+  }();
+  sqlite3_create_module(db, "mem_samples", &module, this);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "front_coded.h"
+#include "pod_array.h"
+#include "sample.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every sample as of one change-log position, by ID, with the row order for
+// each of the other indexed columns. Never changes once built. Stored a column
+// at a time, so a scan over one attribute reads nothing else. The tags are
+// kept back to back in an arena, the paths front coded in path order, where
+// neighbours share most of their directories.
+class SampleSnapshot
+{
+public:
+  // Columns of the mem_samples table, named like the ones of the samples view.
+  enum Column
+  {
+    Id,
+    Filepath,
+    Size,
+    Duration,
+    SampleRate,
+    BitDepth,
+    Channels,
+    Tags,
+    ColumnCount
+  };
+
+  // Strings back to back; string i is [offsets[i], offsets[i + 1]).
+  struct Strings
+  {
+    PodArray<char> arena;
+    PodArray<uint64_t> offsets;
+
+    std::string_view operator[](size_t idx) const
+    {
+      return {arena.data() + offsets[idx], offsets[idx + 1] - offsets[idx]};
+    }
+    void push_back(std::string_view text);
+  };
+
+  // One array per column, all in row order but the paths.
+  struct Columns
+  {
+    PodArray<long long> id;
+    FrontCodedStrings filepath;        // in the order of order(Filepath)
+    PodArray<uint32_t> filepath_rank; // position of the row's path in `filepath`
+    PodArray<long long> size;
+    PodArray<double> duration;
+    PodArray<int> sample_rate;
+    PodArray<int> bit_depth;
+    PodArray<int> channels;
+    Strings tags;
+  };
+
+  // Collects the rows of a snapshot, which have to come in ID order.
+  class Builder
+  {
+  public:
+    void reserve(size_t rows, size_t filepath_bytes, size_t tags_bytes);
+    void add(const SampleRef &row);
+
+  private:
+    friend class SampleSnapshot;
+    Columns columns_;
+    Strings filepaths_; // in row order, until they are sorted and coded
+  };
+
+  SampleSnapshot(Builder rows, long long seq);
+
+  size_t size() const { return columns_.id.size(); }
+  const Columns &columns() const { return columns_; }
+  // The row gathered from the columns. Its tags point into the snapshot, its
+  // path into the reader.
+  SampleRef row(size_t idx, FrontCodedStrings::Reader &paths) const;
+  long long seq() const { return seq_; }
+  // Row indexes sorted by the column, ties by ID; empty for Id and Tags, which
+  // are in row order and not indexed.
+  const PodArray<uint32_t> &order(Column column) const { return orders_[column]; }
+
+  // Writes the snapshot to `path` for map(), through a temporary file that
+  // only replaces it once complete and on the disk. `library_id` tells which
+  // library it is a copy of.
+  bool save(const std::string &path, long long library_id) const;
+  // The snapshot a save() wrote to `path`, its columns read from the mapped
+  // file in place, so only the pages a query touches are ever loaded. Null if
+  // there is no such file, it is not one this build wrote for that library or
+  // it is damaged.
+  static std::shared_ptr<const SampleSnapshot> map(const std::string &path,
+                                                   long long library_id);
+
+private:
+  SampleSnapshot() = default;
+  // Calls io(array) for each array in file order, the paths as one.
+  template <typename Self, typename Io>
+  static void arrays(Self &self, Io &io);
+
+  Columns columns_;
+  long long seq_ = 0;
+  PodArray<uint32_t> orders_[ColumnCount];
+  std::shared_ptr<const void> mapping_; // the file the arrays view, if mapped
+};
+
+// Holds the snapshot the mem_samples virtual table reads and registers the
+// table on connections. A refresh swaps the snapshot whole; queries already
+// running keep reading the one they started on.
+class SampleStore
+{
+public:
+  // Makes mem_samples available to SQL on the connection, as a table that
+  // needs no CREATE VIRTUAL TABLE and leaves the schema alone. The store has
+  // to outlive the connection.
+  void attach(sqlite3 *db);
+  // Null until the first set().
+  std::shared_ptr<const SampleSnapshot> get() const;
+  // Ignored if the current snapshot is newer.
+  void set(std::shared_ptr<const SampleSnapshot> snapshot);
+
+private:
+  mutable std::mutex mutex_;
+  std::shared_ptr<const SampleSnapshot> snapshot_;
+};
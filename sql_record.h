@@ -0,0 +1,177 @@
+#pragma once
+
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Statement binding and row reading for structs that list their fields with
+// SER_PROPS, generated from that list at compile time. Fields map to
+// parameters and result columns in declaration order.
+
+// Bound and read as a blob rather than as text.
+struct SqlBlob
+{
+  std::string bytes;
+};
+
+namespace sql_record
+{
+// Text and blobs are bound SQLITE_STATIC: the record has to outlive the step.
+template <typename T>
+void bind_field(sqlite3_stmt *stmt, int idx, const T &value)
+{
+  if constexpr (std::is_same_v<T, std::string>)
+    sqlite3_bind_text(stmt, idx, value.data(), static_cast<int>(value.size()), SQLITE_STATIC);
+  else if constexpr (std::is_same_v<T, SqlBlob>)
+    sqlite3_bind_blob(
+      stmt, idx, value.bytes.data(), static_cast<int>(value.bytes.size()), SQLITE_STATIC);
+  else if constexpr (std::is_floating_point_v<T>)
+    sqlite3_bind_double(stmt, idx, value);
+  else
+  {
+    static_assert(std::is_integral_v<T>, "no SQL type for this field");
+    sqlite3_bind_int64(stmt, idx, static_cast<sqlite3_int64>(value));
+  }
+}
+
+// A string_view points into the row, and is good until the next step.
+template <typename T>
+void read_field(sqlite3_stmt *stmt, int col, T &value)
+{
+  if constexpr (std::is_same_v<T, std::string_view>)
+  {
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+    value = text ? T{text, static_cast<size_t>(sqlite3_column_bytes(stmt, col))} : T{};
+  }
+  else if constexpr (std::is_same_v<T, std::string>)
+  {
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+    value.assign(text ? text : "", text ? sqlite3_column_bytes(stmt, col) : 0);
+  }
+  else if constexpr (std::is_same_v<T, SqlBlob>)
+  {
+    auto data = static_cast<const char *>(sqlite3_column_blob(stmt, col));
+    value.bytes.assign(data ? data : "", data ? sqlite3_column_bytes(stmt, col) : 0);
+  }
+  else if constexpr (std::is_floating_point_v<T>)
+    value = static_cast<T>(sqlite3_column_double(stmt, col));
+  else
+  {
+    static_assert(std::is_integral_v<T>, "no SQL type for this field");
+    value = static_cast<T>(sqlite3_column_int64(stmt, col));
+  }
+}
+
+struct Binder
+{
+  sqlite3_stmt *stmt;
+  int idx;
+  template <typename... Fields>
+  void operator()(const char *, const Fields &...fields)
+  {
+    (bind_field(stmt, idx++, fields), ...);
+  }
+};
+
+struct Reader
+{
+  sqlite3_stmt *stmt;
+  int col;
+  template <typename... Fields>
+  void operator()(const char *, Fields &...fields)
+  {
+    (read_field(stmt, col++, fields), ...);
+  }
+};
+
+// Splits the stringized field list SER_PROPS passes along.
+struct Names
+{
+  std::vector<std::string> names;
+  template <typename... Fields>
+  void operator()(const char *list, const Fields &...)
+  {
+    std::string name;
+    for (const char *p = list;; ++p)
+      if (*p == ',' || *p == '\0')
+      {
+        names.push_back(name);
+        name.clear();
+        if (*p == '\0')
+          break;
+      }
+      else if (*p != ' ')
+        name += *p;
+  }
+};
+} // namespace sql_record
+
+// Binds the fields to the parameters from `idx` on; returns the next free one.
+template <typename T>
+int bind_record(sqlite3_stmt *stmt, const T &record, int idx = 1)
+{
+  sql_record::Binder binder{stmt, idx};
+  record.ser(binder);
+  return binder.idx;
+}
+
+// Reads the fields from the result columns starting at `col`.
+template <typename T>
+void read_record(sqlite3_stmt *stmt, T &record, int col = 0)
+{
+  sql_record::Reader reader{stmt, col};
+  record.deser(reader);
+}
+
+// The field names, in declaration order.
+template <typename T>
+const std::vector<std::string> &record_fields()
+{
+  static const auto ret = [] {
+    sql_record::Names names;
+    T{}.ser(names);
+    return names.names;
+  }();
+  return ret;
+}
+
+// "a, b, c" from the field names, for statements whose columns are named alike.
+template <typename T>
+std::string record_columns()
+{
+  std::string ret;
+  for (const auto &field : record_fields<T>())
+    ret += (ret.empty() ? "" : ", ") + field;
+  return ret;
+}
+
+// An INSERT of one row into `table`, whose columns carry the field names.
+template <typename T>
+std::string insert_sql(const std::string &table)
+{
+  std::string params;
+  for (size_t i = 0; i < record_fields<T>().size(); ++i)
+    params += i ? ", ?" : "?";
+  return "INSERT INTO " + table + " (" + record_columns<T>() + ") VALUES (" + params + ");";
+}
+
+// Runs an INSERT such as insert_sql<T>() makes once per record, resetting it in
+// between, so the batch shares one prepared statement; run it in a transaction
+// for the rows to share one commit too. `inserted(record)` follows each row,
+// while sqlite3_last_insert_rowid() still gives its ID, and returns false to
+// stop. Stops at the first row that fails, which sqlite3_errmsg() describes.
+template <typename T, typename Inserted>
+bool insert_records(sqlite3_stmt *stmt, const std::vector<T> &records, Inserted &&inserted)
+{
+  for (const auto &record : records)
+  {
+    bind_record(stmt, record);
+    const bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    if (!ok || !inserted(record))
+      return false;
+  }
+  return true;
+}
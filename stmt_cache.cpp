@@ -0,0 +1,122 @@
+#include "stmt_cache.h"
+#include <chrono>
+#include <log/log.hpp>
+#include <utility>
+
+StmtCache::Stmt::Stmt(Stmt &&other) noexcept
+  : stmt_(std::exchange(other.stmt_, nullptr)), entry_(std::exchange(other.entry_, nullptr))
+{
+}
+
+StmtCache::Stmt &StmtCache::Stmt::operator=(Stmt &&other) noexcept
+{
+  if (this != &other)
+  {
+    release();
+    stmt_ = std::exchange(other.stmt_, nullptr);
+    entry_ = std::exchange(other.entry_, nullptr);
+  }
+  return *this;
+}
+
+StmtCache::Stmt::~Stmt()
+{
+  release();
+}
+
+void StmtCache::Stmt::release()
+{
+  if (!stmt_)
+    return;
+  if (entry_)
+  {
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+    entry_->in_use = false;
+  }
+  else
+    sqlite3_finalize(stmt_);
+  stmt_ = nullptr;
+  entry_ = nullptr;
+}
+
+StmtCache::StmtCache(sqlite3 *db, size_t capacity) : db_(db), capacity_(capacity) {}
+
+StmtCache::~StmtCache()
+{
+  clear();
+}
+
+StmtCache::Stmt StmtCache::get(const std::string &sql)
+{
+  auto it = entries_.find(sql);
+  if (it != entries_.end() && !it->second.in_use)
+  {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    auto &entry = it->second;
+    lru_.splice(lru_.begin(), lru_, entry.lru_pos);
+    entry.in_use = true;
+    return Stmt{entry.stmt, &entry};
+  }
+
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  sqlite3_stmt *stmt = nullptr;
+  // The same SQL already leased out (a nested use) gets a one-off statement
+  // instead of sharing the cached one.
+  const bool cache_it = it == entries_.end() && capacity_ > 0;
+  const auto start = std::chrono::steady_clock::now();
+  int rc = sqlite3_prepare_v3(
+    db_, sql.c_str(), -1, cache_it ? SQLITE_PREPARE_PERSISTENT : 0, &stmt, nullptr);
+  if (rc != SQLITE_OK)
+  {
+    LOG("SQL error preparing statement:", sqlite3_errmsg(db_), sql);
+    sqlite3_finalize(stmt);
+    return {};
+  }
+  if (on_prepare)
+    on_prepare(stmt,
+               std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - start)
+                 .count());
+  if (!cache_it)
+    return Stmt{stmt, nullptr};
+
+  auto &[key, entry] = *entries_.emplace(sql, Entry{}).first;
+  entry.stmt = stmt;
+  entry.in_use = true;
+  lru_.push_front(&key);
+  entry.lru_pos = lru_.begin();
+  evict();
+  return Stmt{stmt, &entry};
+}
+
+void StmtCache::evict()
+{
+  // Walk from the least recently used end; statements currently leased out
+  // are skipped, so the cache may briefly exceed its capacity.
+  for (auto it = lru_.end(); entries_.size() > capacity_ && it != lru_.begin();)
+  {
+    --it;
+    auto entry = entries_.find(**it);
+    if (entry->second.in_use)
+      continue;
+    sqlite3_finalize(entry->second.stmt);
+    it = lru_.erase(it);
+    entries_.erase(entry);
+  }
+}
+
+void StmtCache::clear()
+{
+  for (auto it = entries_.begin(); it != entries_.end();)
+  {
+    if (it->second.in_use)
+    {
+      ++it;
+      continue;
+    }
+    sqlite3_finalize(it->second.stmt);
+    lru_.erase(it->second.lru_pos);
+    it = entries_.erase(it);
+  }
+}
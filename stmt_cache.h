@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+
+// Bounded LRU cache of prepared statements for one connection, keyed by SQL
+// text. Statements are handed out as leases; returning a lease resets the
+// statement and clears its bindings so the next user gets it ready to bind.
+// Not thread-safe: a cache belongs to its connection and whoever holds it,
+// only the counters may be read from other threads.
+class StmtCache
+{
+  struct Entry;
+
+public:
+  class Stmt
+  {
+  public:
+    Stmt() = default;
+    Stmt(const Stmt &) = delete;
+    Stmt &operator=(const Stmt &) = delete;
+    Stmt(Stmt &&other) noexcept;
+    Stmt &operator=(Stmt &&other) noexcept;
+    ~Stmt();
+
+    explicit operator bool() const { return stmt_ != nullptr; }
+    operator sqlite3_stmt *() const { return stmt_; }
+    sqlite3_stmt *get() const { return stmt_; }
+
+  private:
+    friend class StmtCache;
+    Stmt(sqlite3_stmt *stmt, Entry *entry) : stmt_(stmt), entry_(entry) {}
+    void release();
+
+    sqlite3_stmt *stmt_ = nullptr;
+    Entry *entry_ = nullptr; // nullptr for one-off statements that are finalized on release
+  };
+
+  StmtCache(sqlite3 *db, size_t capacity = 64);
+  ~StmtCache();
+  StmtCache(const StmtCache &) = delete;
+  StmtCache &operator=(const StmtCache &) = delete;
+
+  // Returns an empty Stmt and logs the error if the SQL fails to prepare.
+  Stmt get(const std::string &sql);
+  void clear();
+
+  size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+  size_t size() const { return entries_.size(); }
+  size_t capacity() const { return capacity_; }
+
+  // Called with the time sqlite3_prepare_v3 took for every statement prepared.
+  std::function<void(sqlite3_stmt *stmt, long long ns)> on_prepare;
+
+private:
+  struct Entry
+  {
+    sqlite3_stmt *stmt = nullptr;
+    bool in_use = false;
+    std::list<const std::string *>::iterator lru_pos;
+  };
+
+  void evict();
+
+  sqlite3 *db_;
+  size_t capacity_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<const std::string *> lru_; // most recently used at the front
+  std::atomic<size_t> hits_ = 0;
+  std::atomic<size_t> misses_ = 0;
+};
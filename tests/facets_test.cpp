@@ -0,0 +1,74 @@
+#include "../facets.h"
+#include "../filter.h"
+#include <cstdio>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+  if (!(cond))                                                             \
+  {                                                                        \
+    std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    ++failures;                                                            \
+  }
+
+static const FacetValue *find_value(const std::vector<Facet> &facets,
+                                    const std::string &facet,
+                                    const std::string &label)
+{
+  for (const auto &f : facets)
+    if (f.name == facet)
+      for (const auto &value : f.values)
+        if (value.label == label)
+          return &value;
+  return nullptr;
+}
+
+// Clicking a facet value has to filter on that value, whatever it holds.
+static void check_term(const FacetValue *value, FilterTerm::Kind kind, const std::string &text)
+{
+  CHECK(value);
+  if (!value)
+    return;
+  const auto ast = FilterAst::parse(value->term);
+  CHECK(ast.errors.empty());
+  CHECK(ast.terms.size() == 1);
+  if (ast.terms.size() != 1)
+    return;
+  CHECK(ast.terms[0].kind == kind);
+  CHECK(ast.terms[0].text == text);
+}
+
+int main()
+{
+  FacetBuilder builder;
+  builder.add(FacetBuilder::Folder, "/lib/12\" vinyl/", 3);
+  builder.add(FacetBuilder::Folder, "/lib/Foley hits/", 2);
+  builder.add(FacetBuilder::Folder, "/lib/kicks/", 1);
+  builder.add(FacetBuilder::Tag, "12\" vinyl", 4);
+  builder.add(FacetBuilder::Tag, "\"quoted\"", 1);
+  builder.add(FacetBuilder::Tag, "say\"hi", 1);
+  builder.add(FacetBuilder::Tag, "impact", 5);
+  const auto facets = builder.build();
+
+  for (const auto &dir : {"12\" vinyl", "Foley hits", "kicks"})
+    check_term(find_value(facets, "Folder", std::string{dir} + "/"),
+               FilterTerm::Kind::Dir,
+               "/lib/" + std::string{dir} + "/");
+  for (const auto &tag : {"12\" vinyl", "\"quoted\"", "say\"hi", "impact"})
+    check_term(find_value(facets, "Tag", tag), FilterTerm::Kind::Tag, tag);
+
+  // The term keeps working next to others and negated.
+  const auto ast = FilterAst::parse("kick -tag:" + FilterAst::quote("12\" vinyl") + " dur<1");
+  CHECK(ast.errors.empty());
+  CHECK(ast.terms.size() == 3);
+  if (ast.terms.size() == 3)
+  {
+    CHECK(ast.terms[1].kind == FilterTerm::Kind::Tag);
+    CHECK(ast.terms[1].negate);
+    CHECK(ast.terms[1].text == "12\" vinyl");
+  }
+
+  if (failures)
+    std::fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+#include "../database.h"
+#include <cstdio>
+#include <filesystem>
+#include <sqlite3.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+  if (!(cond))                                                             \
+  {                                                                        \
+    std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    ++failures;                                                            \
+  }
+
+static long long query_int(sqlite3 *db, const char *sql)
+{
+  sqlite3_stmt *stmt = nullptr;
+  long long ret = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    ret = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return ret;
+}
+
+// A library as the first release wrote it: the samples table and nothing else.
+static bool write_baseline(const std::string &path)
+{
+  sqlite3 *db = nullptr;
+  if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+    return false;
+  const bool ok =
+    sqlite3_exec(db,
+                 "CREATE TABLE samples ("
+                 "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+                 "filepath TEXT NOT NULL,"
+                 "size INT NOT NULL,"
+                 "duration REAL NOT NULL,"
+                 "samplerate INT NOT NULL,"
+                 "bitdepth INT NOT NULL,"
+                 "channels INT NOT NULL,"
+                 "tags TEXT);"
+                 "INSERT INTO samples"
+                 "  (filepath, size, duration, samplerate, bitdepth, channels, tags) VALUES"
+                 "  ('/lib/Foley/door 10.wav', 100, 0.5, 48000, 24, 1, 'wood, impact'),"
+                 "  ('/lib/Foley/door 2.wav', 200, 2.5, 44100, 16, 2, ''),"
+                 "  ('/lib/Foley/Steps/step.wav', 300, 7, 48000, 24, 2, 'steps'),"
+                 "  ('/lib/kicks/kick.wav', 400, 0.2, 44100, 16, 1, 'impact'),"
+                 "  ('loose.wav', 500, 40, 96000, 32, 2, NULL);",
+                 nullptr,
+                 nullptr,
+                 nullptr) == SQLITE_OK;
+  sqlite3_close(db);
+  return ok;
+}
+
+int main()
+{
+  const auto path = (std::filesystem::temp_directory_path() / "sfx_migration_test.db").string();
+  for (const auto suffix : {"", "-wal", "-shm"})
+    std::filesystem::remove(path + suffix);
+  if (!write_baseline(path))
+  {
+    std::fprintf(stderr, "could not write %s\n", path.c_str());
+    return 1;
+  }
+
+  // Opening migrates; the second time finds it current.
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    try
+    {
+      Database db(path);
+      auto reader = db.reader();
+      CHECK(query_int(reader->db, "PRAGMA user_version;") == 11);
+      CHECK(query_int(reader->db, "SELECT count(*) FROM directories WHERE sort_key = x'';") == 0);
+      CHECK(query_int(reader->db,
+                      "SELECT count(*) FROM directories d JOIN directories p"
+                      "  ON p.id = d.parent_id WHERE d.path <> p.path || d.name || '/';") == 0);
+
+      std::vector<Sample> samples;
+      db.load_samples(samples);
+      CHECK(samples.size() == 5);
+      if (samples.size() == 5)
+      {
+        // Natural order by folder, then by name: "door 2" before "door 10".
+        CHECK(samples[0].filepath == "loose.wav");
+        CHECK(samples[1].filepath == "/lib/Foley/door 2.wav");
+        CHECK(samples[2].filepath == "/lib/Foley/door 10.wav");
+        CHECK(samples[3].filepath == "/lib/Foley/Steps/step.wav");
+        CHECK(samples[4].filepath == "/lib/kicks/kick.wav");
+      }
+      CHECK(db.count_samples(SqlFilter::compile("tag:impact")) == 2);
+      CHECK(db.count_samples(SqlFilter::compile("dir:/lib/Foley")) == 3);
+      CHECK(db.count_samples(SqlFilter::compile("wood")) == 1);
+      CHECK(db.count_samples(SqlFilter::compile("ext:wav sr:48000 dur<10")) == 2);
+    }
+    catch (const std::exception &e)
+    {
+      std::fprintf(stderr, "opening the library failed: %s\n", e.what());
+      ++failures;
+      break;
+    }
+  }
+
+  // New samples go into the migrated tables.
+  if (!failures)
+  {
+    Database db(path);
+    Sample sample;
+    sample.filepath = "/lib/kicks/new/kick 2.wav";
+    sample.size = 600;
+    sample.duration = 0.3;
+    sample.sample_rate = 48000;
+    sample.bit_depth = 24;
+    sample.channels = 1;
+    db.insert_sample(sample);
+    CHECK(db.count_samples(SqlFilter::compile("dir:/lib/kicks")) == 2);
+    CHECK(db.count_samples() == 6);
+  }
+
+  for (const auto suffix : {"", "-wal", "-shm"})
+    std::filesystem::remove(path + suffix);
+  if (failures)
+    std::fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}